@@ -0,0 +1,126 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "partitioner.hpp"
+#include "type.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+const size_t num_requests = 100000000;
+
+// Every vpage maps to a block below num_blocks() of its partition and back, and the blocks add up to the vpages
+template <typename PartitionerType>
+bool check_base(const char *name, scache::partition_id_type num_partitions, scache::vpage_id_type num_vpages)
+{
+    PartitionerType partitioner(num_partitions, num_vpages);
+    std::vector<size_t> counts(num_partitions, 0);
+    for (scache::vpage_id_type vpage_id = 0; vpage_id < num_vpages; vpage_id++)
+    {
+        auto [sid, block_id] = partitioner(vpage_id);
+        if (sid >= num_partitions || block_id >= partitioner.num_blocks(sid) || partitioner(sid, block_id) != vpage_id)
+        {
+            printf("%s : %lu partitions, %lu vpages : vpage %lu -> (%lu, %lu) failed\n", name, num_partitions,
+                   num_vpages, vpage_id, sid, block_id);
+            return false;
+        }
+        counts[sid]++;
+    }
+    for (scache::partition_id_type sid = 0; sid < num_partitions; sid++)
+    {
+        if (counts[sid] != partitioner.num_blocks(sid))
+        {
+            printf("%s : %lu partitions, %lu vpages : partition %lu has %lu vpages for %lu blocks\n", name,
+                   num_partitions, num_vpages, sid, counts[sid], partitioner.num_blocks(sid));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same with every group at home, then with groups moved to spare slots of other partitions
+bool check_skew_aware(scache::partition_id_type num_partitions, scache::vpage_id_type num_vpages)
+{
+    using router_type = scache::SkewAwarePartitioner<scache::CachePartitioner>;
+    scache::CachePartitioner base(num_partitions, num_vpages);
+    router_type router(base, num_partitions);
+
+    auto check = [&](const char *phase)
+    {
+        std::vector<std::vector<bool>> used(num_partitions);
+        for (scache::partition_id_type sid = 0; sid < num_partitions; sid++)
+            used[sid].resize(router.num_blocks(sid), false);
+        for (scache::vpage_id_type vpage_id = 0; vpage_id < num_vpages; vpage_id++)
+        {
+            auto [route, sid, block_id] = router.resolve(vpage_id);
+            auto group = router.group_of(vpage_id);
+            auto i = std::get<1>(base(vpage_id)) % scache::HOT_GROUP_PAGES;
+            if (sid >= num_partitions || block_id >= router.num_blocks(sid) || used[sid][block_id] ||
+                i >= router.group_size(group) || router.group_vpage(group, i) != vpage_id)
+            {
+                printf("SkewAware (%s) : %lu partitions, %lu vpages : vpage %lu -> (%lu, %lu) failed\n", phase,
+                       num_partitions, num_vpages, vpage_id, sid, block_id);
+                return false;
+            }
+            used[sid][block_id] = true;
+        }
+        return true;
+    };
+
+    if (!check("home"))
+        return false;
+    for (size_t group = 0; group < router.num_groups(); group++)
+    {
+        auto route = router.reserve(group, (router.home_of(group) + 1) % num_partitions);
+        if (route.has_value())
+            router.set_route(group, route.value());
+    }
+    return check("moved");
+}
+
+int main()
+{
+    bool ok = true;
+    for (scache::partition_id_type num_partitions : {1lu, 2lu, 3lu, 7lu, 16lu})
+    {
+        for (scache::vpage_id_type num_vpages :
+             {1lu, scache::STRIPE_PAGES - 1, scache::STRIPE_PAGES * num_partitions + 1,
+              scache::STRIPE_PAGES * num_partitions * 5 + scache::STRIPE_PAGES / 2 + 3, 100003lu})
+        {
+            ok &= check_base<scache::StripedPartitioner<scache::STRIPE_PAGES>>("Striped", num_partitions, num_vpages);
+            ok &= check_base<scache::HashedStripedPartitioner<scache::STRIPE_PAGES>>("HashedStriped", num_partitions,
+                                                                                     num_vpages);
+            ok &= check_skew_aware(num_partitions, num_vpages);
+        }
+    }
+    printf("Stripe : %lu pages, check : %s\n", scache::STRIPE_PAGES, ok ? "passed" : "failed");
+    if (!ok)
+        return 1;
+
+    const scache::partition_id_type num_partitions = 16;
+    const scache::vpage_id_type num_vpages = 1lu << 30;
+    scache::CachePartitioner partitioner(num_partitions, num_vpages);
+    std::mt19937_64 rand(0);
+    size_t checksum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_requests; i++)
+    {
+        auto [sid, block_id] = partitioner(rand() % num_vpages);
+        checksum += sid + block_id;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("Lookup : %lf ops/s, checksum : %lu\n", 1e9 * num_requests / (end - start).count(), checksum);
+    return 0;
+}
@@ -26,6 +26,7 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
 #include <dlfcn.h>
 #include <numa.h>
@@ -45,6 +46,10 @@ namespace
     std::map<std::string, std::mutex *> *__mmap_file_mutex_dict;
     std::mutex __mmap_file_mutex;
 
+    // Sizes of the blocks handed out by cache_alloc, for free()
+    std::unordered_map<uintptr_t, size_t> *__cache_alloc_sizes;
+    std::mutex __cache_alloc_mutex;
+
     void *(*__real_memcpy)(void *__restrict, const void *__restrict, size_t) = nullptr;
     void *(*__real_memset)(void *, int, size_t) = nullptr;
     void *(*__real_memmove)(void *, const void *, size_t) = nullptr;
@@ -81,6 +86,7 @@ namespace
     bool __disable_parallel_read_write = false;
     bool __disable_thread_bind = false;
     bool __disable_lazy_mmap_writeback = false;
+    bool __persistent = false;
 
     thread_local bool __is_client_threads = false;
 
@@ -185,6 +191,21 @@ __attribute__((constructor(99))) void init()
     if (env_disable_lazy_mmap_writeback)
         __disable_lazy_mmap_writeback = true;
 
+    auto env_io_backend = std::getenv("CACHE_IO_BACKEND");
+    auto io_backend = env_io_backend ? scache::parse_io_backend(env_io_backend) : scache::DEFAULT_IO_BACKEND;
+
+    auto env_io_schedule = std::getenv("CACHE_IO_SCHEDULE");
+    auto io_schedule = env_io_schedule ? scache::parse_io_schedule(env_io_schedule) : scache::IOScheduleConfig();
+
+    auto env_persist_path = std::getenv("CACHE_PERSIST_PATH");
+    if (env_persist_path)
+        __persistent = true;
+
+    auto env_persist_recover = std::getenv("CACHE_PERSIST_RECOVER");
+
+    auto env_max_phy_size = std::getenv("CACHE_MAX_PHY_SIZE");
+    auto max_phy_size = env_max_phy_size ? std::stoul(env_max_phy_size) : phy_size;
+
     auto env_mmap_file_threshold = std::getenv("CACHE_MMAP_FILE_THRESHOLD");
     __mmap_file_threshold = env_mmap_file_threshold ? std::stoul(env_mmap_file_threshold) : __malloc_threshold;
 
@@ -216,7 +237,34 @@ __attribute__((constructor(99))) void init()
         server_paths.emplace_back(path);
     }
 
-    __global_cache = new scache::IntegratedCache(virt_size, phy_size, server_cpus, server_paths, num_clients);
+    __global_cache = new scache::IntegratedCache(virt_size, phy_size, server_cpus, server_paths, num_clients, 1.0,
+                                                 io_backend, env_persist_path ? env_persist_path : "", max_phy_size,
+                                                 io_schedule, env_persist_recover != nullptr);
+    auto parse_io_limit = [](const char *env)
+    {
+        scache::IOLimit limit;
+        if (env)
+        {
+            std::vector<std::string> tokens;
+            boost::split(tokens, env, boost::is_any_of(","));
+            limit.iops = std::stod(tokens[0]);
+            if (tokens.size() > 1)
+                limit.bytes_per_sec = std::stod(tokens[1]);
+        }
+        return limit;
+    };
+    __global_cache->set_io_limit(parse_io_limit(std::getenv("CACHE_IO_LIMIT")),
+                                 parse_io_limit(std::getenv("CACHE_PARTITION_IO_LIMIT")));
+    if (auto env = std::getenv("CACHE_SERVER_IDLE"))
+    {
+        std::vector<std::string> tokens;
+        boost::split(tokens, env, boost::is_any_of(","));
+        auto spin_us = std::stod(tokens[0]);
+        auto pause_us = tokens.size() > 1 ? std::stod(tokens[1]) : 0;
+        __global_cache->set_server_idle_policy(spin_us * 1000, pause_us * 1000);
+    }
+    if (auto env = std::getenv("CACHE_PIN_TIMEOUT_MS"))
+        __global_cache->set_pin_timeout(std::stod(env) * 1e6);
     __global_cached_allocator = new scache::CachedAllocator<unsigned char>(__global_cache);
     __global_base_cached_ptr = new scache::CachedPtr<unsigned char>(__global_cache, 0);
 
@@ -242,6 +290,7 @@ __attribute__((constructor(99))) void init()
 
     __enable_pthread_create_hook = true;
 
+    __cache_alloc_sizes = new std::unordered_map<uintptr_t, size_t>();
     __mmap_file_dict = new std::map<std::string, void *>();
     __mmap_file_mutex_dict = new std::map<std::string, std::mutex *>();
 
@@ -286,6 +335,13 @@ __attribute__((destructor(99))) void deinit()
     }
 #endif
 
+    // A persistent cache has to flush and record its superblock
+    if (__persistent)
+    {
+        delete __global_cache;
+        __global_cache = nullptr;
+    }
+
     // Just to speedup SPDK deinit
     exit(0);
 
@@ -322,7 +378,12 @@ void *cache_alloc(size_t size)
 {
     fprintf(stderr, "cache alloc %lu bytes\n", size);
     auto ptr = __global_cached_allocator->allocate(size);
-    return (void *)(ptr.get_offset() | OFFSET_FLAG);
+    auto addr = ptr.get_offset() | OFFSET_FLAG;
+    {
+        std::lock_guard g{__cache_alloc_mutex};
+        (*__cache_alloc_sizes)[addr] = size;
+    }
+    return (void *)addr;
 }
 
 void cache_free(void *ptr, size_t size)
@@ -345,8 +406,48 @@ void cache_unpin(void *ptr, bool is_write)
     d.unpin(is_write);
 }
 
+void cache_pin_range(void *ptr, size_t size)
+{
+    if (!size)
+        return;
+    auto offset = (uintptr_t)ptr & OFFSET_MASK;
+    std::vector<scache::vpage_id_type> page_ids;
+    for (auto page_id = offset >> scache::CACHE_PAGE_BITS; page_id <= (offset + size - 1) >> scache::CACHE_PAGE_BITS;
+         page_id++)
+        page_ids.emplace_back(page_id);
+    std::vector<void *> pages(page_ids.size());
+    __global_cache->pin_batch(page_ids.data(), page_ids.size(), pages.data());
+}
+
+void cache_unpin_range(void *ptr, size_t size, bool is_write)
+{
+    if (!size)
+        return;
+    auto offset = (uintptr_t)ptr & OFFSET_MASK;
+    std::vector<scache::vpage_id_type> page_ids;
+    for (auto page_id = offset >> scache::CACHE_PAGE_BITS; page_id <= (offset + size - 1) >> scache::CACHE_PAGE_BITS;
+         page_id++)
+        page_ids.emplace_back(page_id);
+    __global_cache->unpin_batch(page_ids.data(), page_ids.size(), is_write);
+}
+
 void cache_flush() { __global_cache->flush(); }
 
+double cache_load_imbalance() { return __global_cache->get_load_imbalance(); }
+
+size_t cache_rebalance(size_t max_groups) { return __global_cache->rebalance(max_groups); }
+
+size_t cache_rebalance_memory(size_t max_pages) { return __global_cache->rebalance_memory(max_pages); }
+
+size_t cache_resize_physical(size_t new_size, void (*progress)(size_t, size_t))
+{
+    if (!progress)
+        return __global_cache->resize_physical(new_size);
+    return __global_cache->resize_physical(new_size, progress);
+}
+
+size_t cache_phy_size() { return __global_cache->get_phy_size(); }
+
 void *cache_malloc_hook(size_t size)
 {
     if (size >= __malloc_threshold && __is_client_threads && check_real_alloc_threshold(size))
@@ -387,6 +488,7 @@ void *cache_aligned_alloc_hook(size_t alignment, size_t size)
                << alignment << std::endl;
             throw std::runtime_error(ss.str());
         }
+        return addr;
     }
     return aligned_alloc(alignment, size);
 }
@@ -395,10 +497,28 @@ void free(void *ptr)
 {
     GET_REAL_SYMBOL(free);
 
-    // TODO: remove traced alloc
     if (((uintptr_t)ptr & OFFSET_FLAG) == 0)
+    {
         __real_free(ptr);
-    // TODO: free cached address
+        return;
+    }
+
+    // The cache is gone after deinit
+    if (!__global_cached_allocator)
+        return;
+    size_t size;
+    {
+        std::lock_guard g{__cache_alloc_mutex};
+        auto iter = __cache_alloc_sizes->find((uintptr_t)ptr);
+        if (iter == __cache_alloc_sizes->end())
+            return;
+        size = iter->second;
+        __cache_alloc_sizes->erase(iter);
+    }
+    if (size >= __trace_real_alloc_threshold)
+        __total_real_alloc.fetch_sub(size);
+    // Drops the pages without write-back
+    cache_free(ptr, size);
 }
 
 void *cache_mmap_hook(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
@@ -1230,6 +1350,23 @@ void cache_dump_profile()
         std::cerr << "#     miss cycles: " << counters[i]->get_profile_cycle_miss() << std::endl;
         counters[i]->clear();
     }
+    auto dump_histogram = [](const char *name, const scache::LogHistogram &histogram)
+    {
+        std::cerr << "#   " << name << ": count " << histogram.get_count() << ", mean " << histogram.get_mean()
+                  << ", p50 " << histogram.get_percentile(0.5) << ", p99 " << histogram.get_percentile(0.99)
+                  << ", p99.9 " << histogram.get_percentile(0.999) << ", max " << histogram.get_max() << std::endl;
+    };
+    for (size_t sid = 0; sid < __global_cache->get_num_partitions(); ++sid)
+    {
+        auto stats = __global_cache->get_io_stats(sid);
+        std::cerr << "# IO of Partition " << sid << ":" << std::endl;
+        dump_histogram(" read latency (ns)", stats.read_latency);
+        dump_histogram("write latency (ns)", stats.write_latency);
+        dump_histogram("      queue depth", stats.queue_depth);
+        std::cerr << "#   throttle stalls: " << stats.num_throttle_stalls << ", stalled ns: " << stats.throttle_stall_ns
+                  << std::endl;
+        std::cerr << "#   I/O errors: " << stats.num_io_errors << std::endl;
+    }
     std::cerr << "########################################" << std::endl;
 #endif
 }
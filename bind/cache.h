@@ -26,6 +26,17 @@ extern "C"
     extern size_t __num_client_cpus;
 
     // load env: CACHE_PHY_SIZE, CACHE_VIRT_SIZE, CACHE_CONFIG, CACHE_NUM_CLIENTS
+    // optional env: CACHE_IO_BACKEND (spdk, aio, uring, uring_registered, uring_sqpoll, uring_iopoll,
+    //               emulator, memcopy, dummy), CACHE_PERSIST_PATH (superblock file, enables persistent mode)
+    //               CACHE_PERSIST_RECOVER (starts a persistent cache that was not shut down cleanly, which is refused
+    //               otherwise; pages not written back before the crash are lost, all blocks are read from the backend)
+    //               CACHE_IO_LIMIT, CACHE_PARTITION_IO_LIMIT ("iops[,bytes_per_sec]", 0 for unlimited)
+    //               CACHE_SERVER_IDLE ("spin_us[,pause_us]", idle server threads sleep afterwards)
+    //               CACHE_PIN_TIMEOUT_MS (pins finding every page pinned fail with "oom" after it, by default they
+    //               wait for an unpin)
+    //               CACHE_MAX_PHY_SIZE (limit of cache_resize_physical, CACHE_PHY_SIZE by default)
+    //               CACHE_IO_SCHEDULE ("key=value,...": policy=read_first|weighted, write_starvation_limit,
+    //               read_weight, write_weight, max_write_ratio, max_inflight_write_ratio)
     extern __attribute__((constructor)) void init();
     extern __attribute__((destructor)) void deinit();
     extern bool cache_space_ptr(const void *ptr);
@@ -35,7 +46,22 @@ extern "C"
     extern void cache_free(void *ptr, size_t size);
     extern void *cache_pin(void *ptr);
     extern void cache_unpin(void *ptr, bool is_write);
+    // Pins every page of [ptr, ptr + size) with all misses in flight together, until cache_unpin_range
+    extern void cache_pin_range(void *ptr, size_t size);
+    extern void cache_unpin_range(void *ptr, size_t size, bool is_write);
     extern void cache_flush();
+    // Busiest partition over the mean since the last cache_rebalance, 1 when balanced
+    extern double cache_load_imbalance();
+    // Moves up to max_groups hot page groups to less loaded partitions, returns the number moved
+    extern size_t cache_rebalance(size_t max_groups);
+    // Moves up to max_pages physical pages to the partition missing most on recently evicted pages
+    extern size_t cache_rebalance_memory(size_t max_pages);
+    // Resizes the physical memory while clients run, progress(done, total) is called in pages after every batch and on
+    // completion (may be NULL). Returns the size reached, short of new_size if pinned pages cannot be released.
+    // Private caches follow on their next pins. Throws on shrinking with uring_registered, uring_sqpoll, uring_iopoll
+    // or spdk, whose frames stay registered.
+    extern size_t cache_resize_physical(size_t new_size, void (*progress)(size_t done, size_t total));
+    extern size_t cache_phy_size();
 
     extern void *cache_memcpy(void *__restrict dst, const void *__restrict src, size_t size);
     extern void *cache_memset(void *dst, int ch, size_t size);
@@ -86,6 +86,9 @@ namespace scache
             }
             else
             {
+                // Small blocks are reused soon by the same thread, large ones are worth dropping before reuse.
+                // The discard sends one request per group of consecutive pages, not one per page.
+                cache->discard(data.get_offset(), 1ul << order);
                 std::lock_guard<std::mutex> lock(mutex);
                 push(large_free_blocks, order, data.get_offset());
             }
@@ -20,6 +20,7 @@
 #include <limits>
 #include <stdexcept>
 #include <type_traits>
+#include <vector>
 
 namespace scache
 {
@@ -213,6 +214,45 @@ namespace scache
             cache->unpin(page_id, is_write);
         }
 
+        // Pins the pages of num pointers, at once in each cache they point into
+        static void pin_batch(const CachedPtr *ptrs, size_t num, pointer *pointers)
+        {
+            for (size_t i = 0; i < num; i++)
+                pointers[i] = nullptr;
+            std::vector<void *> pages;
+            try
+            {
+                for_each_cache(ptrs, num,
+                               [&](IntegratedCache *cache, const auto &page_ids, const auto &indices)
+                               {
+                                   pages.resize(page_ids.size());
+                                   cache->pin_batch(page_ids.data(), page_ids.size(), pages.data());
+                                   for (size_t j = 0; j < indices.size(); j++)
+                                       pointers[indices[j]] = (pointer)((char *)pages[j] +
+                                                                        (ptrs[indices[j]].offset & CACHE_PAGE_MASK));
+                               });
+            }
+            catch (...)
+            {
+                // The caches pinned before the failing one release their pages
+                std::vector<CachedPtr> pinned;
+                for (size_t i = 0; i < num; i++)
+                {
+                    if (pointers[i])
+                        pinned.emplace_back(ptrs[i]);
+                }
+                unpin_batch(pinned.data(), pinned.size(), false);
+                throw;
+            }
+        }
+
+        static void unpin_batch(const CachedPtr *ptrs, size_t num, bool is_write = !is_const)
+        {
+            for_each_cache(ptrs, num,
+                           [&](IntegratedCache *cache, const auto &page_ids, const auto &indices)
+                           { cache->unpin_batch(page_ids.data(), page_ids.size(), is_write); });
+        }
+
         FORCE_INLINE pointer shared_pin() const
         {
             if (unlikely(!cache || offset == NULL_OFFSET))
@@ -236,6 +276,31 @@ namespace scache
         constexpr static bool is_const = std::is_const_v<element_type>;
         constexpr static size_t element_size = sizeof(element_type);
         static_assert(element_size < CACHE_PAGE_SIZE);
+
+        // Calls func(cache, page_ids, indices) once per cache, with the pages of the non-null pointers into it
+        template <typename FuncType> static void for_each_cache(const CachedPtr *ptrs, size_t num, FuncType &&func)
+        {
+            std::vector<vpage_id_type> page_ids;
+            std::vector<size_t> indices;
+            std::vector<bool> grouped(num, false);
+            for (size_t first = 0; first < num; first++)
+            {
+                if (grouped[first] || !ptrs[first].cache || ptrs[first].offset == NULL_OFFSET)
+                    continue;
+                page_ids.clear();
+                indices.clear();
+                for (size_t i = first; i < num; i++)
+                {
+                    if (grouped[i] || ptrs[i].cache != ptrs[first].cache || ptrs[i].offset == NULL_OFFSET)
+                        continue;
+                    grouped[i] = true;
+                    page_ids.emplace_back(ptrs[i].offset >> CACHE_PAGE_BITS);
+                    indices.emplace_back(i);
+                }
+                func(ptrs[first].cache, page_ids, indices);
+            }
+        }
+
         IntegratedCache *cache;
         offset_type offset;
     };
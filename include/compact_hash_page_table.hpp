@@ -296,6 +296,89 @@ namespace scache
             return true;
         }
 
+        // With lock taken by lock_mapping
+        void delete_locked_mapping(vpage_id_type vpage_id, packed_cache_line *hint = nullptr)
+        {
+            uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
+            uint64_t offset = vpage_id % packed_cache_line::NUM_PACK_PAGES;
+
+            auto cacheline = hint ? hint : find_cacheline(tag);
+
+            assert(cacheline && cacheline->tag == tag);
+            assert(cacheline->headers[offset].exist == true);
+            assert(cacheline->headers[offset].busy == true);
+            assert(cacheline->headers[offset].ref_count == 0);
+
+            cacheline->headers[offset].exist = false;
+            cacheline->headers[offset].dirty = false;
+            cacheline->ppage_ids[offset] = packed_cache_line::EMPTY_PPAGE_ID;
+        }
+
+        // With lock taken by create_mapping, drops the new mapping and its pins
+        void abort_mapping(vpage_id_type vpage_id, packed_cache_line *hint = nullptr)
+        {
+            uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
+            uint64_t offset = vpage_id % packed_cache_line::NUM_PACK_PAGES;
+
+            auto cacheline = hint ? hint : find_cacheline(tag);
+
+            assert(cacheline && cacheline->tag == tag);
+            assert(cacheline->headers[offset].exist == true);
+            assert(cacheline->headers[offset].busy == true);
+
+            cacheline->headers[offset].exist = false;
+            cacheline->headers[offset].dirty = false;
+            cacheline->headers[offset].ref_count = 0;
+            cacheline->ppage_ids[offset] = packed_cache_line::EMPTY_PPAGE_ID;
+        }
+
+        // With lock taken by delete_mapping, maps the page again as dirty and unpinned
+        void restore_mapping(vpage_id_type vpage_id, ppage_id_type ppage_id, packed_cache_line *hint = nullptr)
+        {
+            uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
+            uint64_t offset = vpage_id % packed_cache_line::NUM_PACK_PAGES;
+
+            auto cacheline = hint ? hint : find_cacheline(tag);
+
+            assert(cacheline && cacheline->tag == tag);
+            assert(cacheline->headers[offset].exist == false);
+            assert(cacheline->headers[offset].busy == true);
+
+            cacheline->headers[offset].exist = true;
+            cacheline->headers[offset].dirty = true;
+            cacheline->ppage_ids[offset] = ppage_id;
+        }
+
+        // Locks an existing and unpinned mapping, released by release_mapping_lock
+        bool lock_mapping(vpage_id_type vpage_id, packed_cache_line *hint = nullptr)
+        {
+            uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
+            uint64_t offset = vpage_id % packed_cache_line::NUM_PACK_PAGES;
+
+            auto cacheline = hint ? hint : find_cacheline(tag);
+
+            assert(cacheline && cacheline->tag == tag);
+
+            if (!cacheline->headers[offset].exist)
+                return false;
+
+            return cacheline->headers[offset].lock();
+        }
+
+        // With lock
+        void clear_dirty(vpage_id_type vpage_id, packed_cache_line *hint = nullptr)
+        {
+            uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
+            uint64_t offset = vpage_id % packed_cache_line::NUM_PACK_PAGES;
+
+            auto cacheline = hint ? hint : find_cacheline(tag);
+
+            assert(cacheline && cacheline->tag == tag);
+            assert(cacheline->headers[offset].busy == true);
+
+            cacheline->headers[offset].dirty = false;
+        }
+
         bool release_mapping_lock(vpage_id_type vpage_id, packed_cache_line *hint = nullptr)
         {
             uint64_t tag = vpage_id / packed_cache_line::NUM_PACK_PAGES;
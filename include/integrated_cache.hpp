@@ -19,6 +19,7 @@
 #include <boost/fiber/fss.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/tss.hpp>
+#include <functional>
 #include <memory>
 #include <stdexcept>
 
@@ -32,9 +33,24 @@ namespace scache
                         std::vector<size_t> _server_cpus,
                         std::vector<std::string> _server_paths,
                         size_t _max_num_clients,
-                        double _private_occupy_ratio = 1.0)
+                        double _private_occupy_ratio = 1.0,
+                        IOBackendType _io_backend = DEFAULT_IO_BACKEND,
+                        std::string _persist_path = "",
+                        size_t _max_phy_size = 0,
+                        IOScheduleConfig _io_schedule = IOScheduleConfig(),
+                        bool _persist_recover = false)
             : virt_size(_virt_size),
-              shared_cache(_virt_size, _phy_size, _server_cpus, _server_paths, _max_num_clients),
+              shared_cache(_virt_size,
+                           _phy_size,
+                           _server_cpus,
+                           _server_paths,
+                           _max_num_clients,
+                           _io_backend,
+                           _persist_path,
+                           _max_phy_size,
+                           _io_schedule,
+                           nullptr,
+                           _persist_recover),
               private_occupy_ratio(_private_occupy_ratio),
               cache_id(get_cache_id())
         {
@@ -101,15 +117,84 @@ namespace scache
 #endif
         }
 
+        void pin_batch(const vpage_id_type *vpage_ids, size_t num, void **pointers)
+        {
+#ifndef DISABLE_PRIVATE_CACHE
+            get_private_cache()->pin_batch(vpage_ids, num, pointers);
+#else
+            shared_cache.pin_batch(vpage_ids, num, pointers);
+#endif
+        }
+
+        void unpin_batch(const vpage_id_type *vpage_ids, size_t num, bool is_write = false)
+        {
+#ifndef DISABLE_PRIVATE_CACHE
+            get_private_cache()->unpin_batch(vpage_ids, num, is_write);
+#else
+            shared_cache.unpin_batch(vpage_ids, num, is_write);
+#endif
+        }
+
         FORCE_INLINE void *shared_pin(vpage_id_type vpage_id) { return shared_cache.pin(vpage_id); }
 
+        // Bypasses the private cache, the handle unpins the page
+        SharedCache::PinHandle shared_pin_async(vpage_id_type vpage_id) { return shared_cache.pin_async(vpage_id); }
+
         FORCE_INLINE void shared_unpin(vpage_id_type vpage_id, bool is_write = false)
         {
             return shared_cache.unpin(vpage_id, is_write);
         }
 
+        // Pages still pinned by a private or direct cache are kept, their number is returned
+        size_t discard(uintptr_t addr, size_t size) { return shared_cache.discard(addr, size); }
+
         FORCE_INLINE size_t size() const { return virt_size; }
 
+        bool is_reattached() const { return shared_cache.is_reattached(); }
+
+        bool is_recovered() const { return shared_cache.is_recovered(); }
+
+        size_t get_num_partitions() const { return shared_cache.get_num_partitions(); }
+
+        IOBackendType get_io_backend() const { return shared_cache.get_io_backend(); }
+
+        IOStats get_io_stats(size_t sid) const { return shared_cache.get_io_stats(sid); }
+
+        IOStats get_io_stats() const { return shared_cache.get_io_stats(); }
+
+        void set_io_limit(const IOLimit &total, const IOLimit &per_partition)
+        {
+            shared_cache.set_io_limit(total, per_partition);
+        }
+
+        void set_server_idle_policy(uint64_t spin_ns, uint64_t pause_ns)
+        {
+            shared_cache.set_server_idle_policy(spin_ns, pause_ns);
+        }
+
+        void set_pin_timeout(uint64_t timeout_ns) { shared_cache.set_pin_timeout(timeout_ns); }
+
+        // Private caches follow on their next pins, pinned pages stay resident
+        size_t resize_physical(size_t new_phy_size, const std::function<void(size_t, size_t)> &progress = nullptr)
+        {
+            return shared_cache.resize_physical(new_phy_size, progress);
+        }
+
+        size_t get_phy_size() const { return shared_cache.get_phy_size(); }
+
+        size_t get_max_phy_size() const { return shared_cache.get_max_phy_size(); }
+
+        EvictionStats get_eviction_stats() const { return shared_cache.get_eviction_stats(); }
+
+        double get_load_imbalance() const { return shared_cache.get_load_imbalance(); }
+
+        size_t rebalance(size_t max_groups = 8) { return shared_cache.rebalance(max_groups); }
+
+        size_t rebalance_memory(size_t max_pages = MEMORY_BALANCE_BATCH)
+        {
+            return shared_cache.rebalance_memory(max_pages);
+        }
+
         std::array<AccessCounter *, 3> get_access_counters()
         {
             return {&global_counters[GLOBAL_DIRECT], &global_counters[GLOBAL_PRIVATE],
@@ -201,8 +286,9 @@ namespace scache
         {
             static std::atomic_size_t global_cache_id = 0;
             auto cache_id = global_cache_id++;
+            // Thread local caches of a destroyed instance may outlive it, so ids are never reused
             if (cache_id >= MAX_CACHES)
-                throw std::runtime_error("Not support more caches");
+                throw std::runtime_error("Not support more caches, MAX_CACHES bounds all those created by the process");
             return cache_id;
         }
 
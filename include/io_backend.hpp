@@ -13,18 +13,33 @@
 // limitations under the License.
 
 #pragma once
+#include "io_stats.hpp"
+#include "io_throttle.hpp"
 #include "partitioner.hpp"
 #include "type.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <atomic>
 #include <boost/algorithm/string.hpp>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <functional>
 #include <libaio.h>
+#include <linux/fs.h>
+#include <queue>
+#include <random>
 #include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <vector>
 
@@ -43,6 +58,132 @@ extern "C" int rte_thread_register();
 
 namespace scache
 {
+    enum class IOBackendType
+    {
+        Dummy,
+        MemCopy,
+        AIO,
+        IOURing,
+        IOURingRegistered,
+        IOURingSQPoll,
+        IOURingIOPoll,
+        SPDK,
+        SSDEmulator
+    };
+
+    // Backends allocating the frames themselves and registering them for I/O, which locks them in memory
+    constexpr bool registers_frames(IOBackendType type)
+    {
+        return type == IOBackendType::IOURingRegistered || type == IOBackendType::IOURingSQPoll ||
+               type == IOBackendType::IOURingIOPoll || type == IOBackendType::SPDK;
+    }
+
+#ifdef ENABLE_SPDK
+    constexpr IOBackendType DEFAULT_IO_BACKEND = IOBackendType::SPDK;
+#else
+    constexpr IOBackendType DEFAULT_IO_BACKEND = IOBackendType::AIO;
+#endif
+
+    inline IOBackendType parse_io_backend(const std::string &name)
+    {
+        auto lower_name = boost::algorithm::to_lower_copy(name);
+        if (lower_name == "dummy")
+            return IOBackendType::Dummy;
+        if (lower_name == "memcopy" || lower_name == "memcpy")
+            return IOBackendType::MemCopy;
+        if (lower_name == "aio")
+            return IOBackendType::AIO;
+        if (lower_name == "uring" || lower_name == "io_uring" || lower_name == "iouring")
+            return IOBackendType::IOURing;
+        if (lower_name == "uring_registered")
+            return IOBackendType::IOURingRegistered;
+        if (lower_name == "uring_sqpoll")
+            return IOBackendType::IOURingSQPoll;
+        if (lower_name == "uring_iopoll")
+            return IOBackendType::IOURingIOPoll;
+        if (lower_name == "spdk")
+            return IOBackendType::SPDK;
+        if (lower_name == "emulator" || lower_name == "ssd_emulator")
+            return IOBackendType::SSDEmulator;
+        throw std::runtime_error("Unknown IO backend " + name);
+    }
+
+    // tmpfs and some other file systems reject O_DIRECT, fall back to buffered I/O there
+    inline int open_backing_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL)
+            fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Open File Error");
+        return fd;
+    }
+
+    // Block devices are used as they are. Files are grown with fallocate, which leaves unwritten extents
+    // that read as zeros without device I/O, or sparse with ftruncate if the file system cannot.
+    inline void init_backing_file(int fd, size_t size)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            throw std::runtime_error("Init File Error");
+
+        if (S_ISBLK(st.st_mode))
+        {
+            uint64_t device_size = 0;
+            if (ioctl(fd, BLKGETSIZE64, &device_size) != 0 || device_size < size)
+                throw std::runtime_error("Device size error");
+            return;
+        }
+
+        if ((size_t)st.st_size >= size)
+            return;
+        if (fallocate(fd, 0, 0, size) == 0)
+            return;
+        // Out of space and similar errors would only surface at write-back time
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, size) != 0)
+            throw std::runtime_error(std::string("Init File Error: ") + strerror(errno));
+    }
+
+    // Advisory, the caches never read discarded blocks back, so failures are ignored
+    inline void discard_backing_file(int fd, size_t offset, size_t length)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+            return;
+        if (S_ISBLK(st.st_mode))
+        {
+            uint64_t range[2] = {offset, length};
+            ioctl(fd, BLKDISCARD, range);
+        }
+        else
+        {
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+        }
+    }
+
+    // Maps blocks to files and merges them into contiguous runs: func(file_id, block_id, num_blocks)
+    template <typename PartitionerType, typename FuncType>
+    void for_each_block_run(const PartitionerType &partitioner, const std::vector<block_id_type> &ids, FuncType &&func)
+    {
+        std::vector<std::pair<size_t, block_id_type>> blocks;
+        blocks.reserve(ids.size());
+        for (auto id : ids)
+        {
+            auto [file_id, block_id] = partitioner(id);
+            blocks.emplace_back(file_id, block_id);
+        }
+        std::sort(blocks.begin(), blocks.end());
+
+        for (size_t begin = 0, end = 0; begin < blocks.size(); begin = end)
+        {
+            for (end = begin + 1; end < blocks.size() && blocks[end].first == blocks[begin].first &&
+                                  blocks[end].second == blocks[begin].second + (end - begin);
+                 end++)
+                ;
+            func(blocks[begin].first, blocks[begin].second, end - begin);
+        }
+    }
+
     class DummyIO
     {
     public:
@@ -81,7 +222,15 @@ namespace scache
 
         void *get_buffer() { return nullptr; }
 
-        bool write(const block_id_type &id, void *data, bool *finish = nullptr)
+        const IOStats &get_stats() const { return stats; }
+
+        bool sync() { return true; }
+
+        void discard(const std::vector<block_id_type> &ids) {}
+
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle) {}
+
+        bool write(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             // throw std::runtime_error("Swapping-out in DummyIO.");
             if (idle_write_iocbs.empty())
@@ -96,7 +245,7 @@ namespace scache
             return true;
         }
 
-        bool read(const block_id_type &id, void *data, bool *finish = nullptr)
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             // throw std::runtime_error("Swapping-in in DummyIO.");
             if (idle_read_iocbs.empty())
@@ -116,6 +265,9 @@ namespace scache
             auto now = std::chrono::high_resolution_clock::now();
             if (!preparing_iocbs.empty())
             {
+                if constexpr (ENABLE_IO_STATS)
+                    stats.queue_depth.record(read_depth - idle_read_iocbs.size() + write_depth -
+                                             idle_write_iocbs.size());
                 for (auto cb : preparing_iocbs)
                 {
                     cb->start = now;
@@ -127,6 +279,8 @@ namespace scache
             {
                 if (read_iocbs[i].running && read_iocbs[i].start + READ_LATENCY < now)
                 {
+                    if constexpr (ENABLE_IO_STATS)
+                        stats.read_latency.record((now - read_iocbs[i].start).count());
                     if (read_iocbs[i].finish)
                         *read_iocbs[i].finish = true;
                     read_iocbs[i].running = false;
@@ -137,6 +291,8 @@ namespace scache
             {
                 if (write_iocbs[i].running && write_iocbs[i].start + WRITE_LATENCY < now)
                 {
+                    if constexpr (ENABLE_IO_STATS)
+                        stats.write_latency.record((now - write_iocbs[i].start).count());
                     if (write_iocbs[i].finish)
                         *write_iocbs[i].finish = true;
                     write_iocbs[i].running = false;
@@ -164,6 +320,7 @@ namespace scache
         callback_type write_iocbs[MAX_READ_DEPTH];
         std::vector<size_t> idle_write_iocbs;
         std::vector<callback_type *> preparing_iocbs;
+        IOStats stats;
     };
 
     class MemCopy
@@ -198,7 +355,15 @@ namespace scache
 
         void *get_buffer() { return nullptr; }
 
-        bool write(const block_id_type &id, void *data, bool *finish = nullptr)
+        const IOStats &get_stats() const { return stats; }
+
+        bool sync() { return true; }
+
+        void discard(const std::vector<block_id_type> &ids) {}
+
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle) {}
+
+        bool write(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             if (idle_write_iocbs.empty())
             {
@@ -214,7 +379,7 @@ namespace scache
             return true;
         }
 
-        bool read(const block_id_type &id, void *data, bool *finish = nullptr)
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             if (idle_read_iocbs.empty())
             {
@@ -232,11 +397,16 @@ namespace scache
 
         bool progress()
         {
-            auto now = std::chrono::high_resolution_clock::now();
             if (!preparing_iocbs.empty())
             {
+                if constexpr (ENABLE_IO_STATS)
+                    stats.queue_depth.record(MAX_READ_DEPTH - idle_read_iocbs.size() + MAX_WRITE_DEPTH -
+                                             idle_write_iocbs.size());
+                // Latency counts from submission, like the other backends
+                auto now = ENABLE_IO_STATS ? io_stats_now() : 0;
                 for (auto cb : preparing_iocbs)
                 {
+                    cb->start = now;
                     cb->running = true;
                 }
                 preparing_iocbs.clear();
@@ -248,6 +418,8 @@ namespace scache
                     load_fence();
                     memcpy(read_iocbs[i].to, read_iocbs[i].from, CACHE_PAGE_SIZE);
                     save_fence();
+                    if constexpr (ENABLE_IO_STATS)
+                        stats.read_latency.record(io_stats_now() - read_iocbs[i].start);
                     if (read_iocbs[i].finish)
                         *read_iocbs[i].finish = true;
                     read_iocbs[i].running = false;
@@ -261,6 +433,8 @@ namespace scache
                     load_fence();
                     memcpy(write_iocbs[i].to, write_iocbs[i].from, CACHE_PAGE_SIZE);
                     save_fence();
+                    if constexpr (ENABLE_IO_STATS)
+                        stats.write_latency.record(io_stats_now() - write_iocbs[i].start);
                     if (write_iocbs[i].finish)
                         *write_iocbs[i].finish = true;
                     write_iocbs[i].running = false;
@@ -276,6 +450,7 @@ namespace scache
             bool running;
             bool *finish;
             void *from, *to;
+            uint64_t start;
         };
         constexpr static size_t MAX_READ_DEPTH = 4096;
         constexpr static size_t MAX_WRITE_DEPTH = 4096;
@@ -287,39 +462,401 @@ namespace scache
         callback_type write_iocbs[MAX_READ_DEPTH];
         std::vector<size_t> idle_write_iocbs;
         std::vector<callback_type *> preparing_iocbs;
+        IOStats stats;
+    };
+
+#ifndef DEF_MAX_COALESCE_BYTES
+    constexpr size_t MAX_COALESCE_BYTES = 128lu * 1024;
+#else
+    constexpr size_t MAX_COALESCE_BYTES = DEF_MAX_COALESCE_BYTES;
+#endif
+    constexpr size_t MAX_COALESCE_PAGES = std::max(MAX_COALESCE_BYTES / CACHE_PAGE_SIZE, 1lu);
+    // Resubmissions of an interrupted or short transfer before it counts as an I/O error
+    constexpr uint32_t MAX_IO_RETRIES = 8;
+
+    enum class IOSchedulePolicy
+    {
+        // Writes wait while reads are ready, but never more than write_starvation_limit read runs in a row
+        ReadFirst,
+        // read_weight read runs, then write_weight write runs
+        Weighted
+    };
+
+    struct IOScheduleConfig
+    {
+        IOSchedulePolicy policy = IOSchedulePolicy::ReadFirst;
+        size_t write_starvation_limit = 16;
+        size_t read_weight = 4;
+        size_t write_weight = 1;
+        // Shares of the backend depth for write-back, queued and submitted to the device
+        double max_write_ratio = 0.5;
+        double max_inflight_write_ratio = 0.125;
+    };
+
+    // "key=value,..." with keys policy (read_first or weighted), write_starvation_limit, read_weight, write_weight,
+    // max_write_ratio and max_inflight_write_ratio. Keys left out keep their defaults.
+    inline IOScheduleConfig parse_io_schedule(const std::string &options)
+    {
+        IOScheduleConfig config;
+        std::vector<std::string> tokens;
+        boost::split(tokens, options, boost::is_any_of(","), boost::token_compress_on);
+        for (auto &token : tokens)
+        {
+            if (token.empty())
+                continue;
+            std::vector<std::string> kv;
+            boost::split(kv, token, boost::is_any_of("="));
+            if (kv.size() != 2)
+                throw std::runtime_error("Invalid IO schedule option " + token);
+            if (kv[0] == "policy")
+            {
+                auto policy = boost::algorithm::to_lower_copy(kv[1]);
+                if (policy == "read_first")
+                    config.policy = IOSchedulePolicy::ReadFirst;
+                else if (policy == "weighted")
+                    config.policy = IOSchedulePolicy::Weighted;
+                else
+                    throw std::runtime_error("Unknown IO schedule policy " + kv[1]);
+            }
+            else if (kv[0] == "write_starvation_limit")
+                config.write_starvation_limit = std::stoul(kv[1]);
+            else if (kv[0] == "read_weight")
+                config.read_weight = std::stoul(kv[1]);
+            else if (kv[0] == "write_weight")
+                config.write_weight = std::stoul(kv[1]);
+            else if (kv[0] == "max_write_ratio")
+                config.max_write_ratio = std::stod(kv[1]);
+            else if (kv[0] == "max_inflight_write_ratio")
+                config.max_inflight_write_ratio = std::stod(kv[1]);
+            else
+                throw std::runtime_error("Unknown IO schedule option " + kv[0]);
+        }
+        return config;
+    }
+
+    // Collects single-page requests between two submissions of a backend,
+    // and merges runs of contiguous blocks in the same file into one vectored request.
+    // Reads and writes are queued separately and scheduled by IOScheduleConfig.
+    class IOCoalescer
+    {
+    public:
+        struct run_type
+        {
+            IOCoalescer *coalescer;
+            size_t file_id;
+            block_id_type block_id;
+            bool is_write;
+            uint32_t num_pages;
+            // byte cursor for SGL callbacks
+            uint32_t cursor;
+            uint32_t retries;
+            uint64_t start;
+            iovec iovs[MAX_COALESCE_PAGES];
+            bool *finishes[MAX_COALESCE_PAGES];
+            bool *faileds[MAX_COALESCE_PAGES];
+        };
+
+        IOCoalescer(size_t _max_depth, IOScheduleConfig _config = IOScheduleConfig())
+            : max_depth(_max_depth),
+              config(_config),
+              max_write_pages(std::max<size_t>(max_depth * config.max_write_ratio, MAX_COALESCE_PAGES)),
+              max_inflight_write_pages(
+                  std::max<size_t>(max_depth * config.max_inflight_write_ratio, MAX_COALESCE_PAGES)),
+              num_inflight_pages(0),
+              num_submitted_pages(0),
+              num_write_pages(0),
+              num_submitted_write_pages(0),
+              num_read_runs_before_write(0),
+              weighted_turn(0),
+              throttle(nullptr),
+              shared_throttle(nullptr),
+              throttle_stall_start(0),
+              runs(nullptr),
+              idle_runs(),
+              pending(),
+              ready(),
+              stats()
+        {
+            if (config.read_weight + config.write_weight == 0 || config.max_write_ratio <= 0 ||
+                config.max_write_ratio > 1 || config.max_inflight_write_ratio <= 0 ||
+                config.max_inflight_write_ratio > 1)
+                throw std::runtime_error("Invalid IO schedule");
+            runs = (run_type *)mmap_alloc(max_depth * sizeof(run_type));
+            for (size_t i = 0; i < max_depth; i++)
+            {
+                runs[i].coalescer = this;
+                idle_runs.emplace_back(i);
+            }
+            for (int is_write = 0; is_write < 2; is_write++)
+            {
+                pending[is_write].reserve(max_depth);
+                ready[is_write].reserve(max_depth);
+            }
+        }
+
+        IOCoalescer(const IOCoalescer &) = delete;
+        IOCoalescer(IOCoalescer &&) = delete;
+
+        ~IOCoalescer() { mmap_free(runs, max_depth * sizeof(run_type)); }
+
+        // Write-back may only fill its share, so that demand reads always find room
+        bool full(bool is_write) const
+        {
+            if (pending[0].size() + pending[1].size() + num_inflight_pages >= max_depth)
+                return true;
+            return is_write && num_write_pages >= max_write_pages;
+        }
+
+        bool busy() const { return !pending[0].empty() || !pending[1].empty() || num_inflight_pages; }
+
+        const IOStats &get_stats() const { return stats; }
+
+        // Both throttles are owned by the cache, the shared one by all partitions
+        void set_throttle(IOThrottle *_throttle, IOThrottle *_shared_throttle)
+        {
+            throttle = _throttle;
+            shared_throttle = _shared_throttle;
+        }
+
+        // finish is set once the page is transferred, failed instead if it cannot be
+        void push(size_t file_id, block_id_type block_id, void *data, bool *finish, bool *failed, bool is_write)
+        {
+            assert(!full(is_write));
+            pending[is_write].push_back({file_id, block_id, data, finish, failed});
+            num_write_pages += is_write;
+        }
+
+        // submit_func(run_id, run) returns false if the device queue is full,
+        // the left runs are retried in the next submission.
+        template <typename SubmitFuncType> void submit(SubmitFuncType &&submit_func)
+        {
+            build_runs(false);
+            build_runs(true);
+
+            size_t num_submitted[2] = {0, 0};
+            auto now = (ENABLE_IO_STATS || throttle) && (!ready[0].empty() || !ready[1].empty()) ? io_stats_now() : 0;
+            while (true)
+            {
+                bool has_read = num_submitted[0] < ready[0].size();
+                bool has_write = num_submitted[1] < ready[1].size() &&
+                                 (num_submitted_write_pages == 0 ||
+                                  num_submitted_write_pages + runs[ready[1][num_submitted[1]]].num_pages <=
+                                      max_inflight_write_pages);
+                if (!has_read && !has_write)
+                    break;
+
+                bool is_write;
+                if (!has_read || !has_write)
+                {
+                    is_write = has_write;
+                }
+                else if (config.policy == IOSchedulePolicy::ReadFirst)
+                {
+                    is_write = num_read_runs_before_write >= config.write_starvation_limit;
+                }
+                else
+                {
+                    is_write = weighted_turn >= config.read_weight;
+                    weighted_turn = (weighted_turn + 1) % (config.read_weight + config.write_weight);
+                }
+
+                auto run_id = ready[is_write][num_submitted[is_write]];
+                auto &run = runs[run_id];
+                if (throttle && !throttle->admit(run.num_pages * CACHE_PAGE_SIZE, now, shared_throttle))
+                {
+                    if (!throttle_stall_start)
+                    {
+                        throttle_stall_start = now;
+                        relaxed_store(stats.num_throttle_stalls, stats.num_throttle_stalls + 1);
+                    }
+                    break;
+                }
+                if (throttle_stall_start)
+                {
+                    relaxed_store(stats.throttle_stall_ns, stats.throttle_stall_ns + (now - throttle_stall_start));
+                    throttle_stall_start = 0;
+                }
+                if (!submit_func(run_id, run))
+                {
+                    if (throttle)
+                        throttle->refund(run.num_pages * CACHE_PAGE_SIZE, shared_throttle);
+                    break;
+                }
+
+                run.start = now;
+                num_submitted_pages += run.num_pages;
+                num_submitted[is_write]++;
+                if (is_write)
+                {
+                    num_submitted_write_pages += run.num_pages;
+                    num_read_runs_before_write = 0;
+                }
+                else if (has_write)
+                {
+                    num_read_runs_before_write++;
+                }
+            }
+
+            for (int is_write = 0; is_write < 2; is_write++)
+                ready[is_write].erase(ready[is_write].begin(), ready[is_write].begin() + num_submitted[is_write]);
+
+            if constexpr (ENABLE_IO_STATS)
+            {
+                if (num_submitted[0] || num_submitted[1])
+                    stats.queue_depth.record(num_submitted_pages);
+            }
+        }
+
+        // result: bytes transferred or -errno. Transient failures, i.e. short transfers, -EAGAIN and -EINTR, are
+        // submitted again up to MAX_IO_RETRIES times. Device errors such as -EIO are final, as the kernel retried them
+        // already, and backends without a kernel below map retryable device statuses to -EAGAIN. The pages of a run
+        // that fails are not finished, their failed flags are set instead (finish for requests without one), and the
+        // run is counted in num_io_errors. The server loop never throws.
+        void complete(size_t run_id, int64_t result)
+        {
+            auto &run = runs[run_id];
+            bool failed = false;
+            if (result != (int64_t)run.num_pages * CACHE_PAGE_SIZE)
+            {
+                if ((result >= 0 || result == -EAGAIN || result == -EINTR) && run.retries < MAX_IO_RETRIES)
+                {
+                    run.retries++;
+                    num_submitted_pages -= run.num_pages;
+                    if (run.is_write)
+                        num_submitted_write_pages -= run.num_pages;
+                    ready[run.is_write].emplace_back(run_id);
+                    return;
+                }
+                failed = true;
+                relaxed_store(stats.num_io_errors, stats.num_io_errors + 1);
+                fprintf(stderr, "I/O %s error on file %zu block %lu: %s\n", run.is_write ? "write" : "read",
+                        run.file_id, run.block_id, result < 0 ? strerror(-result) : "short transfer");
+            }
+            for (uint32_t i = 0; i < run.num_pages; i++)
+            {
+                if (failed && run.faileds[i])
+                    *run.faileds[i] = true;
+                else if (run.finishes[i])
+                    *run.finishes[i] = true;
+            }
+            if constexpr (ENABLE_IO_STATS)
+            {
+                auto latency = io_stats_now() - run.start;
+                if (run.is_write)
+                    stats.write_latency.record(latency);
+                else
+                    stats.read_latency.record(latency);
+            }
+            num_inflight_pages -= run.num_pages;
+            num_submitted_pages -= run.num_pages;
+            if (run.is_write)
+            {
+                num_write_pages -= run.num_pages;
+                num_submitted_write_pages -= run.num_pages;
+            }
+            idle_runs.emplace_back(run_id);
+        }
+
+        void complete(run_type &run, int64_t result) { complete(&run - runs, result); }
+
+    private:
+        struct request_type
+        {
+            size_t file_id;
+            block_id_type block_id;
+            void *data;
+            bool *finish;
+            bool *failed;
+        };
+
+        void build_runs(bool is_write)
+        {
+            auto &requests = pending[is_write];
+            if (requests.empty())
+                return;
+
+            auto &runs_ready = ready[is_write];
+            auto num_old_runs = runs_ready.size();
+            std::sort(requests.begin(), requests.end(),
+                      [](const request_type &a, const request_type &b)
+                      { return std::tie(a.file_id, a.block_id) < std::tie(b.file_id, b.block_id); });
+            for (const auto &req : requests)
+            {
+                if (runs_ready.size() > num_old_runs)
+                {
+                    auto &run = runs[runs_ready.back()];
+                    if (run.num_pages < MAX_COALESCE_PAGES && run.file_id == req.file_id &&
+                        run.block_id + run.num_pages == req.block_id)
+                    {
+                        append(run, req);
+                        continue;
+                    }
+                }
+                auto run_id = idle_runs.back();
+                idle_runs.pop_back();
+                auto &run = runs[run_id];
+                run.file_id = req.file_id;
+                run.block_id = req.block_id;
+                run.is_write = is_write;
+                run.num_pages = 0;
+                run.cursor = 0;
+                run.retries = 0;
+                append(run, req);
+                runs_ready.emplace_back(run_id);
+            }
+            num_inflight_pages += requests.size();
+            requests.clear();
+        }
+
+        static void append(run_type &run, const request_type &req)
+        {
+            run.iovs[run.num_pages] = {req.data, CACHE_PAGE_SIZE};
+            run.finishes[run.num_pages] = req.finish;
+            run.faileds[run.num_pages] = req.failed;
+            run.num_pages++;
+        }
+
+        const size_t max_depth;
+        const IOScheduleConfig config;
+        const size_t max_write_pages;
+        const size_t max_inflight_write_pages;
+        size_t num_inflight_pages;
+        size_t num_submitted_pages;
+        size_t num_write_pages;
+        size_t num_submitted_write_pages;
+        size_t num_read_runs_before_write;
+        size_t weighted_turn;
+        IOThrottle *throttle;
+        IOThrottle *shared_throttle;
+        uint64_t throttle_stall_start;
+        run_type *runs;
+        std::vector<size_t> idle_runs;
+        // indexed by is_write
+        std::vector<request_type> pending[2];
+        std::vector<size_t> ready[2];
+        IOStats stats;
     };
 
     class AIO
     {
     public:
-        AIO(std::vector<std::string> _paths, block_id_type _num_blocks, ppage_id_type _num_ppages)
+        AIO(std::vector<std::string> _paths,
+            block_id_type _num_blocks,
+            ppage_id_type _num_ppages,
+            IOScheduleConfig _schedule = IOScheduleConfig())
             : paths(_paths),
               num_blocks(_num_blocks),
               fds(),
               partitioner(paths.size(), num_blocks),
+              coalescer(MAX_DEPTH, _schedule),
               iocbs(),
               events(),
-              finishes(),
-              idle_iocbs(),
               preparing_iocbs()
         {
             for (size_t i = 0; i < paths.size(); i++)
             {
-                int fd = open(paths[i].c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
-                if (fd < 0)
-                    throw std::runtime_error("Open File Error");
-                struct stat st;
-                fstat(fd, &st);
-                auto size = st.st_size;
-                const size_t flush_size = 4096;
-                auto data = mmap_alloc(flush_size);
-                for (size_t j = (size + flush_size - 1) / flush_size;
-                     j * flush_size < partitioner.num_blocks(i) * CACHE_PAGE_SIZE; j++)
-                {
-                    if (pwrite(fd, data, flush_size, j * flush_size) != flush_size)
-                        throw std::runtime_error("Init File Error");
-                }
-                mmap_free(data, flush_size);
+                int fd = open_backing_file(paths[i]);
+                init_backing_file(fd, partitioner.num_blocks(i) * CACHE_PAGE_SIZE);
 
                 fds.emplace_back(fd);
             }
@@ -327,13 +864,13 @@ namespace scache
             memset(&ctx, 0, sizeof(io_context_t));
             if (io_setup(MAX_DEPTH, &ctx) != 0)
                 throw std::runtime_error("AIO Setup Error");
-
-            for (size_t i = 0; i < MAX_DEPTH; i++)
-                idle_iocbs.emplace_back(i);
         }
 
-        AIO(std::string _path, block_id_type _num_blocks, ppage_id_type _num_ppages)
-            : AIO(std::vector<std::string>({_path}), _num_blocks, _num_ppages)
+        AIO(std::string _path,
+            block_id_type _num_blocks,
+            ppage_id_type _num_ppages,
+            IOScheduleConfig _schedule = IOScheduleConfig())
+            : AIO(std::vector<std::string>({_path}), _num_blocks, _num_ppages, _schedule)
         {
         }
 
@@ -349,60 +886,91 @@ namespace scache
 
         void *get_buffer() { return nullptr; }
 
-        bool write(const block_id_type &id, void *data, bool *finish = nullptr)
+        const IOStats &get_stats() const { return coalescer.get_stats(); }
+
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle)
+        {
+            coalescer.set_throttle(throttle, shared_throttle);
+        }
+
+        // Returns false if written back data may not have reached the device
+        bool sync()
+        {
+            bool success = true;
+            for (auto &fd : fds)
+                success &= fsync(fd) == 0;
+            return success;
+        }
+
+        void discard(const std::vector<block_id_type> &ids)
+        {
+            for_each_block_run(partitioner, ids,
+                               [&](size_t file_id, block_id_type block_id, block_id_type num_blocks)
+                               {
+                                   discard_backing_file(fds[file_id], block_id * CACHE_PAGE_SIZE,
+                                                        num_blocks * CACHE_PAGE_SIZE);
+                               });
+        }
+
+        bool write(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
-            if (idle_iocbs.empty())
+            if (coalescer.full(true))
             {
                 progress();
                 return false;
             }
-            auto idx = idle_iocbs.back();
-            idle_iocbs.pop_back();
             auto [file_id, block_id] = partitioner(id);
-            auto fd = fds[file_id];
-            io_prep_pwrite(&iocbs[idx], fd, data, CACHE_PAGE_SIZE, block_id * CACHE_PAGE_SIZE);
-            finishes[idx] = finish;
-            preparing_iocbs.emplace_back(&iocbs[idx]);
+            coalescer.push(file_id, block_id, data, finish, failed, true);
             return true;
         }
 
-        bool read(const block_id_type &id, void *data, bool *finish = nullptr)
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
-            if (idle_iocbs.empty())
+            if (coalescer.full(false))
             {
                 progress();
                 return false;
             }
-            auto idx = idle_iocbs.back();
-            idle_iocbs.pop_back();
             auto [file_id, block_id] = partitioner(id);
-            auto fd = fds[file_id];
-            io_prep_pread(&iocbs[idx], fd, data, CACHE_PAGE_SIZE, block_id * CACHE_PAGE_SIZE);
-            finishes[idx] = finish;
-            preparing_iocbs.emplace_back(&iocbs[idx]);
+            coalescer.push(file_id, block_id, data, finish, failed, false);
             return true;
         }
 
         bool progress()
         {
+            coalescer.submit(
+                [&](size_t run_id, IOCoalescer::run_type &run)
+                {
+                    auto fd = fds[run.file_id];
+                    auto offset = run.block_id * CACHE_PAGE_SIZE;
+                    if (run.num_pages == 1 && run.is_write)
+                        io_prep_pwrite(&iocbs[run_id], fd, run.iovs[0].iov_base, CACHE_PAGE_SIZE, offset);
+                    else if (run.num_pages == 1)
+                        io_prep_pread(&iocbs[run_id], fd, run.iovs[0].iov_base, CACHE_PAGE_SIZE, offset);
+                    else if (run.is_write)
+                        io_prep_pwritev(&iocbs[run_id], fd, run.iovs, run.num_pages, offset);
+                    else
+                        io_prep_preadv(&iocbs[run_id], fd, run.iovs, run.num_pages, offset);
+                    preparing_iocbs.emplace_back(&iocbs[run_id]);
+                    return true;
+                });
             if (!preparing_iocbs.empty())
             {
-                if (io_submit(ctx, preparing_iocbs.size(), preparing_iocbs.data()) != preparing_iocbs.size())
-                    throw std::runtime_error("AIO Submit Error");
+                // The runs not taken are submitted again, or failed on a hard error
+                auto ret = io_submit(ctx, preparing_iocbs.size(), preparing_iocbs.data());
+                for (size_t i = std::max(ret, 0); i < preparing_iocbs.size(); i++)
+                    coalescer.complete(preparing_iocbs[i] - iocbs, ret < 0 ? ret : -EAGAIN);
                 preparing_iocbs.clear();
             }
             auto num_ready = io_getevents(ctx, 0, MAX_DEPTH, events, nullptr);
             // auto num_ready = user_io_getevents(ctx, MAX_DEPTH, events);
             for (int i = 0; i < num_ready; i++)
             {
-                auto idx = events[i].obj - iocbs;
-                idle_iocbs.emplace_back(idx);
-                if (finishes[idx])
-                    *finishes[idx] = true;
+                coalescer.complete(events[i].obj - iocbs, (int64_t)events[i].res);
             }
-            return (idle_iocbs.size() != MAX_DEPTH);
+            return coalescer.busy();
         }
 
     private:
@@ -410,12 +978,11 @@ namespace scache
         const std::vector<std::string> paths;
         const block_id_type num_blocks;
         std::vector<int> fds;
-        RoundRobinPartitioner partitioner;
+        StripedPartitioner<STRIPE_PAGES> partitioner;
+        IOCoalescer coalescer;
         io_context_t ctx;
         iocb iocbs[MAX_DEPTH];
         io_event events[MAX_DEPTH];
-        bool *finishes[MAX_DEPTH];
-        std::vector<size_t> idle_iocbs;
         std::vector<iocb *> preparing_iocbs;
 
         constexpr static unsigned AIO_RING_MAGIC = 0xa10a10a1;
@@ -463,99 +1030,451 @@ namespace scache
         }
     };
 
+    // Emulates NVMe SSDs with data kept in memory or in a (tmpfs) file.
+    // path: "<mem|file>[,key=value...]", one path per emulated device
+    //   read_us, write_us: median latency; sigma: log-normal shape of the latency distribution
+    //   channels: internal parallelism, requests beyond it wait for a free channel
+    //   read_mbps, write_mbps, read_kiops, write_kiops: device caps
+    //   interference: read latency slowdown when all channels are writing
+    class SSDEmulator
+    {
+    public:
+        SSDEmulator(std::vector<std::string> _paths,
+                    block_id_type _num_blocks,
+                    ppage_id_type _num_ppages,
+                    IOScheduleConfig _schedule = IOScheduleConfig())
+            : paths(_paths),
+              num_blocks(_num_blocks),
+              devices(paths.size()),
+              partitioner(paths.size(), num_blocks),
+              coalescer(MAX_DEPTH, _schedule),
+              random(std::random_device()()),
+              completions()
+        {
+            for (size_t i = 0; i < paths.size(); i++)
+                init_device(devices[i], paths[i], partitioner.num_blocks(i));
+        }
+
+        SSDEmulator(std::string _path,
+                    block_id_type _num_blocks,
+                    ppage_id_type _num_ppages,
+                    IOScheduleConfig _schedule = IOScheduleConfig())
+            : SSDEmulator(std::vector<std::string>({_path}), _num_blocks, _num_ppages, _schedule)
+        {
+        }
+
+        SSDEmulator(const SSDEmulator &) = delete;
+        SSDEmulator(SSDEmulator &&) = delete;
+
+        ~SSDEmulator()
+        {
+            for (auto &device : devices)
+            {
+                if (device.fd < 0)
+                {
+                    mmap_free(device.data, device.size);
+                }
+                else
+                {
+                    munmap(device.data, device.size);
+                    close(device.fd);
+                }
+            }
+        }
+
+        void *get_buffer() { return nullptr; }
+
+        const IOStats &get_stats() const { return coalescer.get_stats(); }
+
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle)
+        {
+            coalescer.set_throttle(throttle, shared_throttle);
+        }
+
+        bool sync()
+        {
+            bool success = true;
+            for (auto &device : devices)
+            {
+                if (device.fd >= 0)
+                    success &= msync(device.data, device.size, MS_SYNC) == 0;
+            }
+            return success;
+        }
+
+        // Drops the pages of the device image, anonymous memory reads back as zeros
+        void discard(const std::vector<block_id_type> &ids)
+        {
+            for_each_block_run(partitioner, ids,
+                               [&](size_t file_id, block_id_type block_id, block_id_type num_blocks)
+                               {
+                                   auto &device = devices[file_id];
+                                   madvise(device.data + block_id * CACHE_PAGE_SIZE, num_blocks * CACHE_PAGE_SIZE,
+                                           device.fd < 0 ? MADV_DONTNEED : MADV_REMOVE);
+                               });
+        }
+
+        bool write(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
+        {
+            assert(id < num_blocks);
+            if (coalescer.full(true))
+            {
+                progress();
+                return false;
+            }
+            auto [file_id, block_id] = partitioner(id);
+            coalescer.push(file_id, block_id, data, finish, failed, true);
+            return true;
+        }
+
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
+        {
+            assert(id < num_blocks);
+            if (coalescer.full(false))
+            {
+                progress();
+                return false;
+            }
+            auto [file_id, block_id] = partitioner(id);
+            coalescer.push(file_id, block_id, data, finish, failed, false);
+            return true;
+        }
+
+        bool progress()
+        {
+            auto now = io_stats_now();
+            coalescer.submit(
+                [&](size_t run_id, IOCoalescer::run_type &run)
+                {
+                    auto &device = devices[run.file_id];
+                    auto bytes = run.num_pages * CACHE_PAGE_SIZE;
+
+                    // caps serialize requests of one direction on a virtual clock
+                    auto &cap_time = run.is_write ? device.write_cap_time : device.read_cap_time;
+                    cap_time = std::max(cap_time, now) +
+                               (uint64_t)std::max(bytes / (run.is_write ? device.write_bytes_per_ns
+                                                                        : device.read_bytes_per_ns),
+                                                  run.is_write ? device.write_ns_per_io : device.read_ns_per_io);
+
+                    auto latency = sample_latency(run.is_write ? device.write_ns : device.read_ns, device.sigma);
+                    if (!run.is_write)
+                        latency *= 1 + device.interference * device.num_writing / device.channels.size();
+
+                    auto channel = std::min_element(device.channels.begin(), device.channels.end());
+                    auto finish_time = std::max(std::max(*channel, now) + (uint64_t)latency, cap_time);
+                    *channel = finish_time;
+
+                    if (run.is_write)
+                        device.num_writing++;
+                    completions.emplace(finish_time, &run);
+                    return true;
+                });
+
+            while (!completions.empty() && completions.top().first <= now)
+            {
+                auto &run = *completions.top().second;
+                completions.pop();
+
+                auto &device = devices[run.file_id];
+                load_fence();
+                for (uint32_t i = 0; i < run.num_pages; i++)
+                {
+                    auto page = device.data + (run.block_id + i) * CACHE_PAGE_SIZE;
+                    if (run.is_write)
+                        memcpy(page, run.iovs[i].iov_base, CACHE_PAGE_SIZE);
+                    else
+                        memcpy(run.iovs[i].iov_base, page, CACHE_PAGE_SIZE);
+                }
+                save_fence();
+                if (run.is_write)
+                    device.num_writing--;
+                coalescer.complete(run, (int64_t)run.num_pages * CACHE_PAGE_SIZE);
+            }
+            return coalescer.busy();
+        }
+
+    private:
+        struct device_type
+        {
+            double read_ns = 80000, write_ns = 20000, sigma = 0.3;
+            double read_bytes_per_ns = 3.0, write_bytes_per_ns = 2.0;
+            double read_ns_per_io = 1e6 / 700, write_ns_per_io = 1e6 / 300;
+            double interference = 0.5;
+            // time at which each channel becomes free
+            std::vector<uint64_t> channels = std::vector<uint64_t>(32, 0);
+            uint64_t read_cap_time = 0, write_cap_time = 0;
+            size_t num_writing = 0;
+            uint8_t *data = nullptr;
+            size_t size = 0;
+            int fd = -1;
+        };
+
+        static void init_device(device_type &device, const std::string &path, block_id_type num_blocks)
+        {
+            std::vector<std::string> tokens;
+            boost::split(tokens, path, boost::is_any_of(","));
+
+            for (size_t i = 1; i < tokens.size(); i++)
+            {
+                std::vector<std::string> kv;
+                boost::split(kv, tokens[i], boost::is_any_of("="));
+                if (kv.size() != 2)
+                    throw std::runtime_error("Invalid SSD emulator option " + tokens[i]);
+                auto value = std::stod(kv[1]);
+                if (kv[0] == "read_us")
+                    device.read_ns = value * 1e3;
+                else if (kv[0] == "write_us")
+                    device.write_ns = value * 1e3;
+                else if (kv[0] == "sigma")
+                    device.sigma = value;
+                else if (kv[0] == "channels")
+                    device.channels.assign(std::max(value, 1.0), 0);
+                else if (kv[0] == "read_mbps")
+                    device.read_bytes_per_ns = value * 1e-3;
+                else if (kv[0] == "write_mbps")
+                    device.write_bytes_per_ns = value * 1e-3;
+                else if (kv[0] == "read_kiops")
+                    device.read_ns_per_io = 1e6 / value;
+                else if (kv[0] == "write_kiops")
+                    device.write_ns_per_io = 1e6 / value;
+                else if (kv[0] == "interference")
+                    device.interference = value;
+                else
+                    throw std::runtime_error("Unknown SSD emulator option " + kv[0]);
+            }
+
+            device.size = num_blocks * CACHE_PAGE_SIZE;
+            if (tokens[0] == "mem")
+            {
+                device.data = (uint8_t *)mmap_alloc(device.size, CACHE_PAGE_SIZE);
+                if (!device.data)
+                    throw std::runtime_error("Unable to allocate SSD emulator memory");
+            }
+            else
+            {
+                // Only grown like the files of the other backends, data past device.size stays untouched
+                device.fd = open_backing_file(tokens[0]);
+                init_backing_file(device.fd, device.size);
+                device.data =
+                    (uint8_t *)mmap(nullptr, device.size, PROT_READ | PROT_WRITE, MAP_SHARED, device.fd, 0);
+                if (device.data == MAP_FAILED)
+                    throw std::runtime_error("Map File Error");
+            }
+        }
+
+        double sample_latency(double median, double sigma)
+        {
+            if (sigma <= 0)
+                return median;
+            return std::lognormal_distribution<double>(std::log(median), sigma)(random);
+        }
+
+        constexpr static size_t MAX_DEPTH = 4096;
+        const std::vector<std::string> paths;
+        const block_id_type num_blocks;
+        std::vector<device_type> devices;
+        StripedPartitioner<STRIPE_PAGES> partitioner;
+        IOCoalescer coalescer;
+        std::mt19937_64 random;
+        std::priority_queue<std::pair<uint64_t, IOCoalescer::run_type *>,
+                            std::vector<std::pair<uint64_t, IOCoalescer::run_type *>>,
+                            std::greater<std::pair<uint64_t, IOCoalescer::run_type *>>>
+            completions;
+    };
+
 #ifdef ENABLE_URING
-    class IOURing
+    // Registered: register the page buffer and the backing files, and use READ_FIXED / WRITE_FIXED
+    // SQPoll: let a kernel thread poll the submission queue
+    // IOPoll: busy-poll completions on the device, requires O_DIRECT
+    template <bool Registered, bool SQPoll, bool IOPoll> class IOURingBackend
     {
+        static_assert(Registered || (!SQPoll && !IOPoll), "Polling modes require registered buffers and files");
+
     public:
-        IOURing(std::vector<std::string> _paths, block_id_type _num_blocks, ppage_id_type _num_ppages)
+        IOURingBackend(std::vector<std::string> _paths,
+                       block_id_type _num_blocks,
+                       ppage_id_type _num_ppages,
+                       IOScheduleConfig _schedule = IOScheduleConfig())
             : paths(_paths),
               num_blocks(_num_blocks),
+              num_ppages(_num_ppages),
               fds(),
               partitioner(paths.size(), num_blocks),
+              coalescer(MAX_DEPTH, _schedule),
               ring(),
               cqes(),
+              buffer(nullptr),
               num_preparing(),
               num_processing()
         {
             for (size_t i = 0; i < paths.size(); i++)
             {
-                int fd = open(paths[i].c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
-                if (fd < 0)
-                    throw std::runtime_error("Open File Error");
-                struct stat st;
-                fstat(fd, &st);
-                auto size = st.st_size;
-                const size_t flush_size = 4096;
-                auto data = mmap_alloc(flush_size);
-                for (size_t j = (size + flush_size - 1) / flush_size;
-                     j * flush_size < partitioner.num_blocks(i) * CACHE_PAGE_SIZE; j++)
-                {
-                    if (pwrite(fd, data, flush_size, j * flush_size) != flush_size)
-                        throw std::runtime_error("Init File Error");
-                }
-                mmap_free(data, flush_size);
-
+                int fd = open_backing_file(paths[i]);
                 fds.emplace_back(fd);
+                // Polled completions only exist for direct I/O, every buffered request would fail
+                if (IOPoll && !(fcntl(fd, F_GETFL) & O_DIRECT))
+                    throw std::runtime_error("IOURing IOPoll requires O_DIRECT on " + paths[i]);
+                init_backing_file(fd, partitioner.num_blocks(i) * CACHE_PAGE_SIZE);
             }
 
-            if (io_uring_queue_init(MAX_DEPTH, &ring, 0 /*IORING_SETUP_IOPOLL*/) != 0)
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            if constexpr (SQPoll)
+            {
+                params.flags |= IORING_SETUP_SQPOLL;
+                params.sq_thread_idle = SQPOLL_IDLE_MS;
+            }
+            if constexpr (IOPoll)
+            {
+                params.flags |= IORING_SETUP_IOPOLL;
+            }
+
+            if (io_uring_queue_init_params(MAX_DEPTH, &ring, &params) != 0)
                 throw std::runtime_error("IOURing Setup Error");
+
+            if constexpr (Registered)
+            {
+                if (io_uring_register_files(&ring, fds.data(), fds.size()) != 0)
+                    throw std::runtime_error("IOURing Register Files Error");
+
+                buffer = (uint8_t *)mmap_alloc(num_ppages * CACHE_PAGE_SIZE, CACHE_PAGE_SIZE);
+                if (!buffer)
+                    throw std::runtime_error("Unable to allocate IOURing buffer");
+
+                std::vector<iovec> iovecs;
+                for (size_t offset = 0; offset < num_ppages * CACHE_PAGE_SIZE; offset += REGISTER_BUFFER_SIZE)
+                {
+                    iovecs.push_back(
+                        {buffer + offset, std::min(REGISTER_BUFFER_SIZE, num_ppages * CACHE_PAGE_SIZE - offset)});
+                }
+                if (io_uring_register_buffers(&ring, iovecs.data(), iovecs.size()) != 0)
+                    throw std::runtime_error("IOURing Register Buffers Error");
+            }
         }
 
-        IOURing(std::string _path, block_id_type _num_blocks, ppage_id_type _num_ppages)
-            : IOURing(std::vector<std::string>({_path}), _num_blocks, _num_ppages)
+        IOURingBackend(std::string _path,
+                       block_id_type _num_blocks,
+                       ppage_id_type _num_ppages,
+                       IOScheduleConfig _schedule = IOScheduleConfig())
+            : IOURingBackend(std::vector<std::string>({_path}), _num_blocks, _num_ppages, _schedule)
         {
         }
 
-        IOURing(const IOURing &) = delete;
-        IOURing(IOURing &&) = delete;
+        IOURingBackend(const IOURingBackend &) = delete;
+        IOURingBackend(IOURingBackend &&) = delete;
 
-        ~IOURing()
+        ~IOURingBackend()
         {
+            if constexpr (Registered)
+            {
+                io_uring_unregister_buffers(&ring);
+                io_uring_unregister_files(&ring);
+            }
             io_uring_queue_exit(&ring);
+            if (buffer)
+                mmap_free(buffer, num_ppages * CACHE_PAGE_SIZE);
             for (auto &fd : fds)
                 close(fd);
         }
 
-        void *get_buffer() { return nullptr; }
+        void *get_buffer() { return buffer; }
+
+        const IOStats &get_stats() const { return coalescer.get_stats(); }
 
-        bool write(const block_id_type &id, const void *data, bool *finish = nullptr)
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle)
+        {
+            coalescer.set_throttle(throttle, shared_throttle);
+        }
+
+        // Returns false if written back data may not have reached the device
+        bool sync()
+        {
+            bool success = true;
+            for (auto &fd : fds)
+                success &= fsync(fd) == 0;
+            return success;
+        }
+
+        void discard(const std::vector<block_id_type> &ids)
+        {
+            for_each_block_run(partitioner, ids,
+                               [&](size_t file_id, block_id_type block_id, block_id_type num_blocks)
+                               {
+                                   discard_backing_file(fds[file_id], block_id * CACHE_PAGE_SIZE,
+                                                        num_blocks * CACHE_PAGE_SIZE);
+                               });
+        }
+
+        bool write(const block_id_type &id, const void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
-            auto sqe = io_uring_get_sqe(&ring);
-            if (!sqe)
+            if (coalescer.full(true))
             {
                 progress();
                 return false;
             }
             auto [file_id, block_id] = partitioner(id);
-            auto fd = fds[file_id];
-            io_uring_prep_write(sqe, fd, data, CACHE_PAGE_SIZE, block_id * CACHE_PAGE_SIZE);
-            io_uring_sqe_set_data(sqe, finish);
-            num_preparing++;
+            coalescer.push(file_id, block_id, const_cast<void *>(data), finish, failed, true);
             return true;
         }
 
-        bool read(const block_id_type &id, void *data, bool *finish = nullptr)
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
-            auto sqe = io_uring_get_sqe(&ring);
-            if (!sqe)
+            if (coalescer.full(false))
             {
                 progress();
                 return false;
             }
             auto [file_id, block_id] = partitioner(id);
-            auto fd = fds[file_id];
-            io_uring_prep_read(sqe, fd, data, CACHE_PAGE_SIZE, block_id * CACHE_PAGE_SIZE);
-            io_uring_sqe_set_data(sqe, finish);
-            num_preparing++;
+            coalescer.push(file_id, block_id, data, finish, failed, false);
             return true;
         }
 
         bool progress()
         {
-            if (num_preparing)
+            coalescer.submit(
+                [&](size_t run_id, IOCoalescer::run_type &run)
+                {
+                    auto sqe = io_uring_get_sqe(&ring);
+                    if (!sqe)
+                        return false;
+                    auto fd = Registered ? (int)run.file_id : fds[run.file_id];
+                    auto offset = run.block_id * CACHE_PAGE_SIZE;
+                    if (run.num_pages == 1)
+                    {
+                        auto data = run.iovs[0].iov_base;
+                        if constexpr (Registered)
+                        {
+                            if (run.is_write)
+                                io_uring_prep_write_fixed(sqe, fd, data, CACHE_PAGE_SIZE, offset, buffer_index(data));
+                            else
+                                io_uring_prep_read_fixed(sqe, fd, data, CACHE_PAGE_SIZE, offset, buffer_index(data));
+                        }
+                        else
+                        {
+                            if (run.is_write)
+                                io_uring_prep_write(sqe, fd, data, CACHE_PAGE_SIZE, offset);
+                            else
+                                io_uring_prep_read(sqe, fd, data, CACHE_PAGE_SIZE, offset);
+                        }
+                    }
+                    else
+                    {
+                        if (run.is_write)
+                            io_uring_prep_writev(sqe, fd, run.iovs, run.num_pages, offset);
+                        else
+                            io_uring_prep_readv(sqe, fd, run.iovs, run.num_pages, offset);
+                    }
+                    if constexpr (Registered)
+                        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+                    io_uring_sqe_set_data(sqe, &run);
+                    num_preparing++;
+                    return true;
+                });
+
+            // With IOPOLL, completions are only reaped when entering the kernel
+            if (num_preparing || (IOPoll && num_processing))
             {
                 auto ret = io_uring_submit(&ring);
                 if (ret >= 0)
@@ -566,11 +1485,7 @@ namespace scache
             }
             auto num_ready = io_uring_peek_batch_cqe(&ring, cqes, MAX_DEPTH);
             for (int i = 0; i < num_ready; i++)
-            {
-                bool *finish = (bool *)io_uring_cqe_get_data(cqes[i]);
-                if (finish)
-                    *finish = true;
-            }
+                coalescer.complete(*(IOCoalescer::run_type *)io_uring_cqe_get_data(cqes[i]), cqes[i]->res);
             io_uring_cq_advance(&ring, num_ready);
             num_processing -= num_ready;
             // if(num_processing && !num_ready && !io_uring_wait_cqe(&ring, cqes))
@@ -580,20 +1495,37 @@ namespace scache
             //    io_uring_cqe_seen(&ring, cqes[0]);
             //    num_processing--;
             //}
-            return num_processing;
+            return coalescer.busy();
         }
 
     private:
+        int buffer_index(const void *data) const
+        {
+            assert((const uint8_t *)data >= buffer && (const uint8_t *)data < buffer + num_ppages * CACHE_PAGE_SIZE);
+            return ((const uint8_t *)data - buffer) / REGISTER_BUFFER_SIZE;
+        }
+
         constexpr static size_t MAX_DEPTH = 4096;
+        // the kernel limits a single registered buffer to 1GB
+        constexpr static size_t REGISTER_BUFFER_SIZE = 1lu << 30;
+        constexpr static unsigned SQPOLL_IDLE_MS = 1000;
         const std::vector<std::string> paths;
         const block_id_type num_blocks;
+        const ppage_id_type num_ppages;
         std::vector<int> fds;
-        RoundRobinPartitioner partitioner;
+        StripedPartitioner<STRIPE_PAGES> partitioner;
+        IOCoalescer coalescer;
         io_uring ring;
         io_uring_cqe *cqes[MAX_DEPTH];
+        uint8_t *buffer;
         size_t num_preparing;
         size_t num_processing;
     };
+
+    using IOURing = IOURingBackend<false, false, false>;
+    using IOURingRegistered = IOURingBackend<true, false, false>;
+    using IOURingSQPoll = IOURingBackend<true, true, false>;
+    using IOURingIOPoll = IOURingBackend<true, false, true>;
 #endif
 
 #ifdef ENABLE_SPDK
@@ -680,22 +1612,22 @@ namespace scache
                     {
                         auto is_enabled = spdk_nvme_intel_feat_latency_tracking();
                         is_enabled.bits.enable = 0x00;
-                        bool finish = false;
+                        cmd_state_type state;
                         auto ret =
                             spdk_nvme_ctrlr_cmd_set_feature(context.ctrlr, SPDK_NVME_INTEL_FEAT_LATENCY_TRACKING,
-                                                            is_enabled.raw, 0, nullptr, 0, cmd_callback, &finish);
+                                                            is_enabled.raw, 0, nullptr, 0, cmd_callback, &state);
                         if (ret)
                             throw std::runtime_error("Set SSD Latency tracking Error");
-                        while (!finish)
+                        while (!state.finish)
                             spdk_nvme_ctrlr_process_admin_completions(context.ctrlr);
 
                         is_enabled.bits.enable = 0x01;
-                        finish = false;
+                        state = cmd_state_type();
                         ret = spdk_nvme_ctrlr_cmd_set_feature(context.ctrlr, SPDK_NVME_INTEL_FEAT_LATENCY_TRACKING,
-                                                              is_enabled.raw, 0, nullptr, 0, cmd_callback, &finish);
+                                                              is_enabled.raw, 0, nullptr, 0, cmd_callback, &state);
                         if (ret)
                             throw std::runtime_error("Set SSD Latency tracking Error");
-                        while (!finish)
+                        while (!state.finish)
                             spdk_nvme_ctrlr_process_admin_completions(context.ctrlr);
                     }
                 }
@@ -714,24 +1646,24 @@ namespace scache
                         auto write_page = (spdk_nvme_intel_rw_latency_page *)spdk_dma_zmalloc(
                             sizeof(spdk_nvme_intel_rw_latency_page), CACHE_PAGE_SIZE, nullptr);
 
-                        bool finish = false;
+                        cmd_state_type state;
                         auto ret = spdk_nvme_ctrlr_cmd_get_log_page(
                             context.ctrlr, SPDK_NVME_INTEL_LOG_READ_CMD_LATENCY, SPDK_NVME_GLOBAL_NS_TAG, read_page,
-                            sizeof(spdk_nvme_intel_rw_latency_page), 0, cmd_callback, &finish);
+                            sizeof(spdk_nvme_intel_rw_latency_page), 0, cmd_callback, &state);
                         if (ret)
                             continue;
 
-                        while (!finish)
+                        while (!state.finish)
                             spdk_nvme_ctrlr_process_admin_completions(context.ctrlr);
 
-                        finish = false;
+                        state = cmd_state_type();
                         ret = spdk_nvme_ctrlr_cmd_get_log_page(
                             context.ctrlr, SPDK_NVME_INTEL_LOG_WRITE_CMD_LATENCY, SPDK_NVME_GLOBAL_NS_TAG, write_page,
-                            sizeof(spdk_nvme_intel_rw_latency_page), 0, cmd_callback, &finish);
+                            sizeof(spdk_nvme_intel_rw_latency_page), 0, cmd_callback, &state);
                         if (ret)
                             continue;
 
-                        while (!finish)
+                        while (!state.finish)
                             spdk_nvme_ctrlr_process_admin_completions(context.ctrlr);
 
                         for (int i = 0; i < 32; i++)
@@ -767,11 +1699,11 @@ namespace scache
                     {
                         auto is_enabled = spdk_nvme_intel_feat_latency_tracking();
                         is_enabled.bits.enable = 0x00;
-                        bool finish = false;
+                        cmd_state_type state;
                         auto ret =
                             spdk_nvme_ctrlr_cmd_set_feature(context.ctrlr, SPDK_NVME_INTEL_FEAT_LATENCY_TRACKING,
-                                                            is_enabled.raw, 0, nullptr, 0, cmd_callback, &finish);
-                        while (!ret && !finish)
+                                                            is_enabled.raw, 0, nullptr, 0, cmd_callback, &state);
+                        while (!ret && !state.finish)
                             spdk_nvme_ctrlr_process_admin_completions(context.ctrlr);
                     }
                 }
@@ -829,8 +1761,18 @@ namespace scache
         };
 
     public:
-        SPDK(std::vector<std::string> _paths, block_id_type _num_blocks, ppage_id_type _num_ppages)
-            : paths(_paths), num_blocks(_num_blocks), handles(), partitioner(paths.size(), num_blocks)
+        // A persistent SPDK keeps the device contents instead of deallocating them
+        SPDK(std::vector<std::string> _paths,
+             block_id_type _num_blocks,
+             ppage_id_type _num_ppages,
+             bool _persistent = false,
+             IOScheduleConfig _schedule = IOScheduleConfig())
+            : paths(_paths),
+              num_blocks(_num_blocks),
+              persistent(_persistent),
+              handles(),
+              partitioner(paths.size(), num_blocks),
+              coalescer(MAX_DEPTH, _schedule)
         {
             for (size_t i = 0; i < paths.size(); i++)
             {
@@ -875,11 +1817,16 @@ namespace scache
             if (!buffer)
                 throw std::runtime_error("Unable to allocate DMA memory");
 
-            clear();
+            if (!persistent)
+                clear();
         }
 
-        SPDK(std::string _path, block_id_type _num_blocks, ppage_id_type _num_ppages)
-            : SPDK(std::vector<std::string>({_path}), _num_blocks, _num_ppages)
+        SPDK(std::string _path,
+             block_id_type _num_blocks,
+             ppage_id_type _num_ppages,
+             bool _persistent = false,
+             IOScheduleConfig _schedule = IOScheduleConfig())
+            : SPDK(std::vector<std::string>({_path}), _num_blocks, _num_ppages, _persistent, _schedule)
         {
         }
 
@@ -888,7 +1835,8 @@ namespace scache
 
         ~SPDK()
         {
-            clear();
+            if (!persistent)
+                clear();
             for (size_t i = 0; i < handles.size(); i++)
             {
                 auto &handle = handles[i];
@@ -899,48 +1847,119 @@ namespace scache
 
         void *get_buffer() { return buffer; }
 
-        bool write(const block_id_type &id, void *data, bool *finish = nullptr)
+        const IOStats &get_stats() const { return coalescer.get_stats(); }
+
+        void set_throttle(IOThrottle *throttle, IOThrottle *shared_throttle)
         {
-            assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
+            coalescer.set_throttle(throttle, shared_throttle);
+        }
 
-            auto [file_id, block_id] = partitioner(id);
-            auto &handle = handles[file_id];
+        bool sync()
+        {
+            bool success = true;
+            for (auto &handle : handles)
+            {
+                cmd_state_type state;
+                if (spdk_nvme_ns_cmd_flush(handle.ns, handle.qpair, cmd_callback, &state) != 0)
+                {
+                    fprintf(stderr, "SPDK flush cannot be submitted\n");
+                    success = false;
+                    continue;
+                }
+                while (!state.finish)
+                    spdk_nvme_qpair_process_completions(handle.qpair, 0);
+                success &= !state.failed;
+            }
+            return success;
+        }
+
+        // Deallocates with DSM and waits, so that later writes of the blocks cannot be reordered before it
+        void discard(const std::vector<block_id_type> &ids)
+        {
+            std::vector<std::vector<spdk_nvme_dsm_range>> ranges(handles.size());
+            for_each_block_run(partitioner, ids,
+                               [&](size_t file_id, block_id_type block_id, block_id_type num_blocks)
+                               {
+                                   auto &handle = handles[file_id];
+                                   spdk_nvme_dsm_range range = {};
+                                   range.starting_lba = handle.sector_base + block_id * handle.num_sector_per_page;
+                                   range.length = num_blocks * handle.num_sector_per_page;
+                                   ranges[file_id].emplace_back(range);
+                               });
+
+            for (size_t i = 0; i < handles.size(); i++)
+            {
+                auto &handle = handles[i];
+                for (size_t begin = 0; begin < ranges[i].size(); begin += SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES)
+                {
+                    auto num_ranges =
+                        std::min<size_t>(SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES, ranges[i].size() - begin);
+                    // Advisory like on files, a failed deallocation leaves the blocks as they are
+                    cmd_state_type state;
+                    if (spdk_nvme_ns_cmd_dataset_management(handle.ns, handle.qpair, SPDK_NVME_DSM_ATTR_DEALLOCATE,
+                                                            &ranges[i][begin], num_ranges, cmd_callback, &state) != 0)
+                        continue;
+                    while (!state.finish)
+                        spdk_nvme_qpair_process_completions(handle.qpair, 0);
+                }
+            }
+        }
 
-            auto ret = spdk_nvme_ns_cmd_write(handle.ns, handle.qpair, data,
-                                              handle.sector_base + block_id * handle.num_sector_per_page,
-                                              handle.num_sector_per_page, cmd_callback, finish, 0);
+        bool write(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
+        {
+            assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
 
-            if (ret)
+            if (coalescer.full(true))
             {
                 progress();
                 return false;
             }
 
+            auto [file_id, block_id] = partitioner(id);
+            coalescer.push(file_id, block_id, data, finish, failed, true);
+
             return true;
         }
 
-        bool read(const block_id_type &id, void *data, bool *finish = nullptr)
+        bool read(const block_id_type &id, void *data, bool *finish = nullptr, bool *failed = nullptr)
         {
             assert(id < num_blocks && ((uintptr_t)data) % CACHE_PAGE_SIZE == 0);
 
-            auto [file_id, block_id] = partitioner(id);
-            auto &handle = handles[file_id];
-
-            auto ret = spdk_nvme_ns_cmd_read(handle.ns, handle.qpair, data,
-                                             handle.sector_base + block_id * handle.num_sector_per_page,
-                                             handle.num_sector_per_page, cmd_callback, finish, 0);
-
-            if (ret)
+            if (coalescer.full(false))
             {
                 progress();
                 return false;
             }
 
+            auto [file_id, block_id] = partitioner(id);
+            coalescer.push(file_id, block_id, data, finish, failed, false);
+
             return true;
         }
 
         bool progress()
         {
+            coalescer.submit(
+                [&](size_t run_id, IOCoalescer::run_type &run)
+                {
+                    auto &handle = handles[run.file_id];
+                    auto lba = handle.sector_base + run.block_id * handle.num_sector_per_page;
+                    auto lba_count = run.num_pages * handle.num_sector_per_page;
+                    int ret;
+                    if (run.num_pages == 1 && run.is_write)
+                        ret = spdk_nvme_ns_cmd_write(handle.ns, handle.qpair, run.iovs[0].iov_base, lba, lba_count,
+                                                     run_callback, &run, 0);
+                    else if (run.num_pages == 1)
+                        ret = spdk_nvme_ns_cmd_read(handle.ns, handle.qpair, run.iovs[0].iov_base, lba, lba_count,
+                                                    run_callback, &run, 0);
+                    else if (run.is_write)
+                        ret = spdk_nvme_ns_cmd_writev(handle.ns, handle.qpair, lba, lba_count, run_callback, &run, 0,
+                                                      reset_sgl, next_sge);
+                    else
+                        ret = spdk_nvme_ns_cmd_readv(handle.ns, handle.qpair, lba, lba_count, run_callback, &run, 0,
+                                                     reset_sgl, next_sge);
+                    return ret == 0;
+                });
             std::atomic_thread_fence(std::memory_order_acq_rel);
             for (auto &handle : handles)
             {
@@ -950,18 +1969,51 @@ namespace scache
         }
 
     private:
+        // Completion of a command waited for in place
+        struct cmd_state_type
+        {
+            bool finish = false;
+            bool failed = false;
+        };
+
         static void cmd_callback(void *arg, const spdk_nvme_cpl *completion)
         {
+            auto &state = *(cmd_state_type *)arg;
+            if (spdk_nvme_cpl_is_error(completion))
+            {
+                fprintf(stderr, "SPDK command error status: %s\n",
+                        spdk_nvme_cpl_get_status_string(&completion->status));
+                state.failed = true;
+            }
+            std::atomic_thread_fence(std::memory_order_acq_rel);
+            state.finish = true;
+        }
+
+        static void run_callback(void *arg, const spdk_nvme_cpl *completion)
+        {
+            auto &run = *(IOCoalescer::run_type *)arg;
             if (spdk_nvme_cpl_is_error(completion))
             {
-                printf("I/O error status: %s\n", spdk_nvme_cpl_get_status_string(&completion->status));
+                // Statuses without Do Not Retry are transient, like -EAGAIN of the kernel
+                run.coalescer->complete(run, completion->status.dnr ? -EIO : -EAGAIN);
                 return;
             }
-            if (arg)
-                *(bool *)arg = true;
+            run.coalescer->complete(run, (int64_t)run.num_pages * CACHE_PAGE_SIZE);
             std::atomic_thread_fence(std::memory_order_acq_rel);
         }
 
+        static void reset_sgl(void *arg, uint32_t offset) { ((IOCoalescer::run_type *)arg)->cursor = offset; }
+
+        static int next_sge(void *arg, void **address, uint32_t *length)
+        {
+            auto &run = *(IOCoalescer::run_type *)arg;
+            auto page_offset = run.cursor % CACHE_PAGE_SIZE;
+            *address = (uint8_t *)run.iovs[run.cursor / CACHE_PAGE_SIZE].iov_base + page_offset;
+            *length = CACHE_PAGE_SIZE - page_offset;
+            run.cursor += *length;
+            return 0;
+        }
+
         struct nvme_qpair_handle_type
         {
             spdk_nvme_ctrlr *ctrlr;
@@ -983,21 +2035,24 @@ namespace scache
                     dsm_range.starting_lba = handle.sector_base;
                     dsm_range.length = partitioner.num_blocks(i) * handle.num_sector_per_page;
 
-                    bool finish = false;
+                    cmd_state_type state;
 
                     auto rc = spdk_nvme_ns_cmd_dataset_management(
-                        handle.ns, handle.qpair, SPDK_NVME_DSM_ATTR_DEALLOCATE, &dsm_range, 1, cmd_callback, &finish);
+                        handle.ns, handle.qpair, SPDK_NVME_DSM_ATTR_DEALLOCATE, &dsm_range, 1, cmd_callback, &state);
 
-                    while (!finish)
+                    while (!rc && !state.finish)
                         spdk_nvme_qpair_process_completions(handle.qpair, 0);
                 }
             }
         }
 
+        constexpr static size_t MAX_DEPTH = 4096;
         const std::vector<std::string> paths;
         const block_id_type num_blocks;
+        const bool persistent;
         std::vector<nvme_qpair_handle_type> handles;
-        RoundRobinPartitioner partitioner;
+        StripedPartitioner<STRIPE_PAGES> partitioner;
+        IOCoalescer coalescer;
         void *buffer;
     };
 #endif
@@ -0,0 +1,190 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "type.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace scache
+{
+    constexpr bool ENABLE_IO_STATS = true;
+
+    inline uint64_t io_stats_now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Statistics have a single writer, the server thread, and are read by others with relaxed atomic accesses
+    template <typename T> FORCE_INLINE T relaxed_load(const T &value)
+    {
+        return __atomic_load_n(&value, __ATOMIC_RELAXED);
+    }
+
+    template <typename T> FORCE_INLINE void relaxed_store(T &value, T new_value)
+    {
+        __atomic_store_n(&value, new_value, __ATOMIC_RELAXED);
+    }
+
+    // HDR-style histogram: values below NUM_SUB_BUCKETS are exact,
+    // every larger power of two is split into NUM_SUB_BUCKETS linear sub-buckets.
+    class LogHistogram
+    {
+    public:
+        constexpr static size_t SUB_BUCKET_BITS = 4;
+        constexpr static size_t NUM_SUB_BUCKETS = 1lu << SUB_BUCKET_BITS;
+        constexpr static size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * NUM_SUB_BUCKETS;
+
+        LogHistogram() { clear(); }
+
+        FORCE_INLINE void record(uint64_t value)
+        {
+            auto &bucket = buckets[index(value)];
+            relaxed_store(bucket, bucket + 1);
+            relaxed_store(count, count + 1);
+            relaxed_store(sum, sum + value);
+            if (value > max)
+                relaxed_store(max, value);
+        }
+
+        // Consistent per counter while the writer keeps recording
+        LogHistogram snapshot() const
+        {
+            LogHistogram copy;
+            for (size_t i = 0; i < NUM_BUCKETS; i++)
+                copy.buckets[i] = relaxed_load(buckets[i]);
+            copy.count = relaxed_load(count);
+            copy.sum = relaxed_load(sum);
+            copy.max = relaxed_load(max);
+            return copy;
+        }
+
+        void merge(const LogHistogram &other)
+        {
+            for (size_t i = 0; i < NUM_BUCKETS; i++)
+                buckets[i] += other.buckets[i];
+            count += other.count;
+            sum += other.sum;
+            max = std::max(max, other.max);
+        }
+
+        void clear()
+        {
+            memset(buckets, 0, sizeof(buckets));
+            count = sum = max = 0;
+        }
+
+        uint64_t get_count() const { return count; }
+        uint64_t get_max() const { return max; }
+        double get_mean() const { return count ? (double)sum / count : 0; }
+
+        // Upper bound of the bucket holding the p-th (0 ~ 1) value
+        uint64_t get_percentile(double p) const
+        {
+            if (!count)
+                return 0;
+            uint64_t rank = std::max<uint64_t>(1, std::min<uint64_t>(count, p * count + 0.5));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < NUM_BUCKETS; i++)
+            {
+                seen += buckets[i];
+                if (seen >= rank)
+                    return std::min(upper_bound(i), max);
+            }
+            return max;
+        }
+
+        // func(lower, upper, count) for every non-empty bucket
+        template <typename FuncType> void for_each_bucket(FuncType &&func) const
+        {
+            for (size_t i = 0; i < NUM_BUCKETS; i++)
+            {
+                if (buckets[i])
+                    func(lower_bound(i), upper_bound(i), buckets[i]);
+            }
+        }
+
+        static size_t index(uint64_t value)
+        {
+            if (value < NUM_SUB_BUCKETS)
+                return value;
+            size_t shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+            return (shift + 1) * NUM_SUB_BUCKETS + (value >> shift) - NUM_SUB_BUCKETS;
+        }
+
+        static uint64_t lower_bound(size_t index)
+        {
+            if (index < NUM_SUB_BUCKETS)
+                return index;
+            size_t shift = index / NUM_SUB_BUCKETS - 1;
+            return (NUM_SUB_BUCKETS + index % NUM_SUB_BUCKETS) << shift;
+        }
+
+        static uint64_t upper_bound(size_t index)
+        {
+            return index + 1 < NUM_BUCKETS ? lower_bound(index + 1) - 1 : std::numeric_limits<uint64_t>::max();
+        }
+
+    private:
+        uint64_t buckets[NUM_BUCKETS];
+        uint64_t count, sum, max;
+    };
+
+    // Per-backend statistics, written by the owning server thread only
+    struct IOStats
+    {
+        LogHistogram read_latency;  // ns from device submission to completion
+        LogHistogram write_latency; // ns from device submission to completion
+        LogHistogram queue_depth;   // pages in flight, sampled at each submission
+        uint64_t num_throttle_stalls = 0;
+        uint64_t throttle_stall_ns = 0; // time with requests held back by IOThrottle
+        uint64_t num_io_errors = 0;     // runs failed after all retries
+
+        IOStats snapshot() const
+        {
+            IOStats copy;
+            copy.read_latency = read_latency.snapshot();
+            copy.write_latency = write_latency.snapshot();
+            copy.queue_depth = queue_depth.snapshot();
+            copy.num_throttle_stalls = relaxed_load(num_throttle_stalls);
+            copy.throttle_stall_ns = relaxed_load(throttle_stall_ns);
+            copy.num_io_errors = relaxed_load(num_io_errors);
+            return copy;
+        }
+
+        void merge(const IOStats &other)
+        {
+            read_latency.merge(other.read_latency);
+            write_latency.merge(other.write_latency);
+            queue_depth.merge(other.queue_depth);
+            num_throttle_stalls += other.num_throttle_stalls;
+            throttle_stall_ns += other.throttle_stall_ns;
+            num_io_errors += other.num_io_errors;
+        }
+
+        void clear()
+        {
+            read_latency.clear();
+            write_latency.clear();
+            queue_depth.clear();
+            num_throttle_stalls = throttle_stall_ns = num_io_errors = 0;
+        }
+    };
+} // namespace scache
@@ -0,0 +1,108 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "type.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+namespace scache
+{
+    // 0 means unlimited
+    struct IOLimit
+    {
+        double iops = 0;
+        double bytes_per_sec = 0;
+    };
+
+    // Token bucket in GCRA form: tat is the time at which the bucket is full again.
+    // Lock-free, so that a bucket can be shared by the server threads of a cache.
+    class TokenBucket
+    {
+    public:
+        TokenBucket() : ns_per_unit(0), tat(0) {}
+
+        void set_rate(double units_per_sec) { ns_per_unit = units_per_sec > 0 ? 1e9 / units_per_sec : 0; }
+
+        bool limited() const { return ns_per_unit.load(std::memory_order_relaxed) > 0; }
+
+        bool consume(double units, uint64_t now)
+        {
+            auto cost = cost_of(units);
+            auto old_tat = tat.load(std::memory_order_relaxed);
+            while (true)
+            {
+                auto start = std::max(old_tat, now);
+                if (start - now > BURST_NS)
+                    return false;
+                if (tat.compare_exchange_weak(old_tat, start + cost, std::memory_order_relaxed))
+                    return true;
+            }
+        }
+
+        void refund(double units) { tat.fetch_sub(cost_of(units), std::memory_order_relaxed); }
+
+    private:
+        uint64_t cost_of(double units) const { return units * ns_per_unit.load(std::memory_order_relaxed); }
+
+        constexpr static uint64_t BURST_NS = 10'000'000;
+        std::atomic<double> ns_per_unit;
+        std::atomic_uint64_t tat;
+    };
+
+    class IOThrottle
+    {
+    public:
+        void set_limit(const IOLimit &limit)
+        {
+            iops.set_rate(limit.iops);
+            bandwidth.set_rate(limit.bytes_per_sec);
+        }
+
+        bool limited() const { return iops.limited() || bandwidth.limited(); }
+
+        // Takes the tokens of one request from this throttle and the next one, all or nothing
+        bool admit(size_t bytes, uint64_t now, IOThrottle *next = nullptr)
+        {
+            if (iops.limited() && !iops.consume(1, now))
+                return false;
+            if (bandwidth.limited() && !bandwidth.consume(bytes, now))
+            {
+                iops.refund(1);
+                return false;
+            }
+            if (next && !next->admit(bytes, now))
+            {
+                iops.refund(1);
+                bandwidth.refund(bytes);
+                return false;
+            }
+            return true;
+        }
+
+        // Returns the tokens of an admitted request that was not issued
+        void refund(size_t bytes, IOThrottle *next = nullptr)
+        {
+            iops.refund(1);
+            bandwidth.refund(bytes);
+            if (next)
+                next->refund(bytes);
+        }
+
+    private:
+        TokenBucket iops;
+        TokenBucket bandwidth;
+    };
+} // namespace scache
@@ -0,0 +1,189 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "integrated_cache.hpp"
+#include "type.hpp"
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace scache
+{
+    // Splits one physical memory budget among the IntegratedCache instances of a process. Every member is guaranteed
+    // its min_size and shares the rest by weight, then rebalance() shifts memory towards the members whose misses
+    // more memory would turn into hits, per unit of weight. Members stay within [min_size, max_phy_size] and must be
+    // able to shrink, so backends registering their frames are refused. Only memory is shared, every member keeps
+    // its own server threads.
+    class MemoryBudget
+    {
+    public:
+        MemoryBudget(size_t _total_size) : total_size(_total_size / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE) {}
+
+        MemoryBudget(const MemoryBudget &) = delete;
+        MemoryBudget(MemoryBudget &&) = delete;
+
+        // Resizes all members, the new one included, to their shares
+        void add(IntegratedCache &cache, double weight = 1.0, size_t min_size = 0)
+        {
+            std::lock_guard lock(mutex);
+            // Every partition needs a page
+            min_size = std::max(round_up(min_size), cache.get_num_partitions() * CACHE_PAGE_SIZE);
+            if (weight <= 0 || min_size > cache.get_max_phy_size())
+                throw std::runtime_error("Parameter Error");
+            if (registers_frames(cache.get_io_backend()))
+                throw std::runtime_error("Frames registered by the IO backend cannot be released");
+            size_t sum_min_size = min_size;
+            for (auto &member : members)
+                sum_min_size += member.min_size;
+            if (sum_min_size > total_size)
+                throw std::runtime_error("Memory budget exceeded");
+
+            members.push_back({&cache, weight, min_size, cache.get_eviction_stats().num_ghost_hits});
+            resize(shares(), total_size);
+        }
+
+        // The cache shrinks to a page per partition, what it released goes to the others. The pages it keeps (and
+        // pinned ones it could not release) stay out of the budget until it is destroyed and the next add or remove.
+        void remove(IntegratedCache &cache)
+        {
+            std::lock_guard lock(mutex);
+            auto iter = std::find_if(members.begin(), members.end(),
+                                     [&](const member_type &member) { return member.cache == &cache; });
+            if (iter == members.end())
+                return;
+            members.erase(iter);
+            auto held = cache.resize_physical(cache.get_num_partitions() * CACHE_PAGE_SIZE);
+            resize(shares(), total_size - held);
+        }
+
+        // Moves up to step bytes to the member with the most ghost hits per weight since the last call, from the one
+        // with the fewest, if that one had at most half as many. Returns the bytes moved.
+        size_t rebalance(size_t step = MEMORY_BALANCE_BATCH * CACHE_PAGE_SIZE)
+        {
+            std::lock_guard lock(mutex);
+            std::vector<double> gains(members.size());
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                auto hits = members[i].cache->get_eviction_stats().num_ghost_hits;
+                gains[i] = (hits - members[i].last_ghost_hits) / members[i].weight;
+                members[i].last_ghost_hits = hits;
+            }
+
+            size_t to = members.size(), from = members.size();
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                auto size = members[i].cache->get_phy_size();
+                if (size < members[i].cache->get_max_phy_size() && (to == members.size() || gains[i] > gains[to]))
+                    to = i;
+            }
+            if (to == members.size() || gains[to] == 0)
+                return 0;
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                if (i != to && members[i].cache->get_phy_size() > members[i].min_size &&
+                    (from == members.size() || gains[i] < gains[from]))
+                    from = i;
+            }
+            if (from == members.size() || gains[from] * 2 > gains[to])
+                return 0;
+
+            auto from_size = members[from].cache->get_phy_size();
+            auto to_size = members[to].cache->get_phy_size();
+            auto num = std::min({round_up(step), from_size - members[from].min_size,
+                                 members[to].cache->get_max_phy_size() - to_size});
+            // The receiver only grows by what the donor released
+            auto moved = from_size - members[from].cache->resize_physical(from_size - num);
+            if (moved)
+                members[to].cache->resize_physical(to_size + moved);
+            return moved;
+        }
+
+        size_t get_total_size() const { return total_size; }
+
+    private:
+        struct member_type
+        {
+            IntegratedCache *cache;
+            double weight;
+            size_t min_size;
+            size_t last_ghost_hits;
+        };
+
+        static size_t round_up(size_t size) { return (size + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE; }
+
+        // Min sizes plus the rest by weight, what exceeds the max_phy_size of a member is passed on to the others
+        std::vector<size_t> shares() const
+        {
+            std::vector<size_t> sizes(members.size());
+            std::vector<bool> full(members.size(), false);
+            size_t left = total_size;
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                sizes[i] = members[i].min_size;
+                left -= sizes[i];
+            }
+            while (left >= CACHE_PAGE_SIZE)
+            {
+                double sum_weight = 0;
+                for (size_t i = 0; i < members.size(); i++)
+                    sum_weight += full[i] ? 0 : members[i].weight;
+                size_t given = 0;
+                for (size_t i = 0; i < members.size() && sum_weight > 0; i++)
+                {
+                    if (full[i])
+                        continue;
+                    auto size = (size_t)(left * (members[i].weight / sum_weight)) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+                    auto room = members[i].cache->get_max_phy_size() - sizes[i];
+                    if (size >= room)
+                    {
+                        size = room;
+                        full[i] = true;
+                    }
+                    sizes[i] += size;
+                    given += size;
+                }
+                if (!given)
+                    break;
+                left -= given;
+            }
+            return sizes;
+        }
+
+        // Shrinks first, so that the members never hold more than limit together
+        void resize(const std::vector<size_t> &sizes, size_t limit)
+        {
+            size_t used = 0;
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                if (sizes[i] < members[i].cache->get_phy_size())
+                    members[i].cache->resize_physical(sizes[i]);
+                used += members[i].cache->get_phy_size();
+            }
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                auto size = members[i].cache->get_phy_size();
+                if (sizes[i] <= size || used >= limit)
+                    continue;
+                auto grow = std::min(sizes[i] - size, limit - used);
+                used += members[i].cache->resize_physical(size + grow) - size;
+            }
+        }
+
+        const size_t total_size;
+        std::vector<member_type> members;
+        std::mutex mutex;
+    };
+} // namespace scache
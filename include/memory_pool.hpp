@@ -16,13 +16,18 @@
 #include "type.hpp"
 #include "util.hpp"
 #include <cassert>
+#include <cstring>
+#include <sys/mman.h>
 
 namespace scache
 {
     class MemoryPool
     {
     public:
-        MemoryPool(ppage_id_type _num_pages, void *_pool = nullptr) : num_pages(_num_pages)
+        // With all_loaded, the first load of every page reads the backend (e.g. a reattached persistent cache).
+        // An external pool is only released when releasable, not when registered with the device.
+        MemoryPool(ppage_id_type _num_pages, void *_pool = nullptr, bool all_loaded = false, bool _releasable = false)
+            : num_pages(_num_pages), releasable(_releasable)
         {
             if (_pool)
             {
@@ -37,6 +42,7 @@ namespace scache
             }
 
             first_loaded = (bool *)mmap_alloc(num_pages);
+            memset(first_loaded, all_loaded, num_pages);
         }
 
         MemoryPool(const MemoryPool &) = delete;
@@ -69,11 +75,26 @@ namespace scache
             return before;
         }
 
+        // Frames first used after evictions started must read the backend
+        void mark_loaded(ppage_id_type begin, ppage_id_type end) { memset(first_loaded + begin, true, end - begin); }
+
+        // Returns the memory of a free frame to the OS. External buffers may be shared memory, whose pages stay in
+        // the segment unless punched out, and are kept as they are unless releasable.
+        void release(const ppage_id_type &id)
+        {
+            auto page = from_page_id(id);
+            if (!is_external)
+                madvise(page, CACHE_PAGE_SIZE, MADV_DONTNEED);
+            else if (releasable && madvise(page, CACHE_PAGE_SIZE, MADV_REMOVE) != 0)
+                madvise(page, CACHE_PAGE_SIZE, MADV_DONTNEED);
+        }
+
     private:
         ppage_id_type num_pages;
         uint8_t *pool = nullptr;
         uint8_t *mmap_pool = nullptr;
         bool *first_loaded = nullptr;
         bool is_external;
+        bool releasable;
     };
 } // namespace scache
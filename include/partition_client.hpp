@@ -159,6 +159,20 @@ namespace scache
             }
         }
 
+        // Non-blocking poll_message: false while a message to sid is in flight or the request of epoch is unsent
+        bool try_poll_message(size_t sid, size_t epoch = 0)
+        {
+            process_message(sid);
+            if (local_message_processing[sid])
+                return false;
+            if (epoches[sid] <= epoch)
+            {
+                submit_message(sid);
+                return false;
+            }
+            return true;
+        }
+
         void wait()
         {
             for (size_t sid = 0; sid < server.cpus.size(); sid++)
@@ -198,6 +212,9 @@ namespace scache
             local_message_processing[sid] = true;
 
             server.requests[sid][cid] = local_message_pool[sid];
+            server.activate(sid, cid);
+            if constexpr (ENABLE_SERVER_SLEEP)
+                server.notify(sid);
 
             epoches[sid]++;
         }
@@ -13,32 +13,54 @@
 // limitations under the License.
 
 #pragma once
+#include "io_stats.hpp"
 #include "partition_type.hpp"
 #include "type.hpp"
 #include "util.hpp"
+#include <atomic>
 #include <boost/circular_buffer.hpp>
 #include <boost/fiber/all.hpp>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <linux/futex.h>
+#include <memory>
 #include <mutex>
 #include <numa.h>
 #include <optional>
 #include <pthread.h>
 #include <queue>
 #include <stdexcept>
+#include <sys/syscall.h>
 #include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unistd.h>
 #include <vector>
 #include <xmmintrin.h>
 
 namespace scache
 {
+    // Written by the owning server thread only
+    struct ServerIdleStats
+    {
+        uint64_t num_sleeps = 0;
+        uint64_t sleep_ns = 0;
+        LogHistogram wakeup_latency; // ns from a doorbell ring to the server thread running again
+    };
+
     class PartitionServer
     {
         friend class PartitionClient;
 
+        struct alignas(CACHELINE_SIZE) doorbell_type
+        {
+            std::atomic_uint32_t seq{0};
+            std::atomic_bool sleeping{false};
+            std::atomic_uint64_t ring_time{0};
+        };
+
     public:
         PartitionServer(std::vector<size_t> _cpus, size_t _num_clients)
             : cpus(_cpus),
@@ -47,6 +69,7 @@ namespace scache
               requests(),
               responses_pool(),
               responses(),
+              active_clients(),
               numa_threads(),
               threads(),
               num_ready_threads(0),
@@ -54,6 +77,10 @@ namespace scache
               client_id_pool(),
               client_toggles(),
               mutex(),
+              doorbells(new doorbell_type[_cpus.size()]),
+              idle_stats(_cpus.size()),
+              idle_spin_ns(DEFAULT_SERVER_SPIN_NS),
+              idle_pause_ns(DEFAULT_SERVER_PAUSE_NS),
               is_stop(false),
               is_run(false)
         {
@@ -83,15 +110,19 @@ namespace scache
 
         ~PartitionServer()
         {
-            is_stop = true;
-            for (auto &t : threads)
-                t.join();
+            stop();
 
             for (size_t i = 0; i < num_clients; i++)
             {
                 mmap_free(client_toggles, num_clients * MAX_THREADS);
             }
 
+            for (size_t sid = 0; sid < cpus.size(); sid++)
+            {
+                if (active_clients[sid] != nullptr)
+                    mmap_free(active_clients[sid], num_active_words() * sizeof(uint64_t));
+            }
+
             for (size_t i = 0; i < MAX_NUMANODES; i++)
             {
                 if (requests_pool[i] != nullptr)
@@ -101,6 +132,17 @@ namespace scache
             }
         }
 
+        // Stops the server threads after destroying their contexts
+        void stop()
+        {
+            is_stop = true;
+            for (size_t sid = 0; sid < threads.size(); sid++)
+                ring(sid);
+            for (auto &t : threads)
+                t.join();
+            threads.clear();
+        }
+
         template <typename CreateContextFuncType,
                   typename PreProcessFuncType,
                   typename FirstProcessFuncType,
@@ -111,6 +153,56 @@ namespace scache
                  FirstProcessFuncType first_process_func,
                  ProcessFuncType process_func,
                  DestroyContextFuncType destroy_context_func)
+        {
+            run(create_context_func, pre_process_func, first_process_func, process_func, destroy_context_func,
+                [](auto &context) FORCE_INLINE { return false; });
+        }
+
+        // Idle server threads poll for spin_ns, then pause for pause_ns, then sleep until woken by a client
+        void set_idle_policy(uint64_t spin_ns, uint64_t pause_ns)
+        {
+            idle_spin_ns = spin_ns;
+            idle_pause_ns = pause_ns;
+        }
+
+        const ServerIdleStats &get_idle_stats(size_t sid) const { return idle_stats[sid]; }
+
+        // idle_func is called by the server thread after each loop without new requests,
+        // and returns whether it still has background work, which keeps the server thread awake
+        template <typename CreateContextFuncType,
+                  typename PreProcessFuncType,
+                  typename FirstProcessFuncType,
+                  typename ProcessFuncType,
+                  typename DestroyContextFuncType,
+                  typename IdleFuncType>
+        void run(CreateContextFuncType create_context_func,
+                 PreProcessFuncType pre_process_func,
+                 FirstProcessFuncType first_process_func,
+                 ProcessFuncType process_func,
+                 DestroyContextFuncType destroy_context_func,
+                 IdleFuncType idle_func)
+        {
+            run(create_context_func, pre_process_func, first_process_func, process_func, destroy_context_func,
+                idle_func, [](auto &context, auto &&push) FORCE_INLINE {});
+        }
+
+        // resume_func(context, push) is called by the server thread after each loop, and hands requests kept aside
+        // by the processing functions back to process_func with push(request, async_context).
+        // Only with USING_FIBER_ASYNC_RESPONSE, as resumed requests have no message left to answer in.
+        template <typename CreateContextFuncType,
+                  typename PreProcessFuncType,
+                  typename FirstProcessFuncType,
+                  typename ProcessFuncType,
+                  typename DestroyContextFuncType,
+                  typename IdleFuncType,
+                  typename ResumeFuncType>
+        void run(CreateContextFuncType create_context_func,
+                 PreProcessFuncType pre_process_func,
+                 FirstProcessFuncType first_process_func,
+                 ProcessFuncType process_func,
+                 DestroyContextFuncType destroy_context_func,
+                 IdleFuncType idle_func,
+                 ResumeFuncType resume_func)
         {
             if (is_run)
                 return;
@@ -120,10 +212,10 @@ namespace scache
                 threads.emplace_back(
                     [this, sid = i, create_context_func = create_context_func, pre_process_func = pre_process_func,
                      first_process_func = first_process_func, process_func = process_func,
-                     destroy_context_func = destroy_context_func]()
+                     destroy_context_func = destroy_context_func, idle_func = idle_func, resume_func = resume_func]()
                     {
                         this->server_loop(sid, create_context_func, pre_process_func, first_process_func, process_func,
-                                          destroy_context_func);
+                                          destroy_context_func, idle_func, resume_func);
                     });
             }
 
@@ -176,17 +268,93 @@ namespace scache
         }
 
     private:
+        // Called by clients after publishing a message
+        FORCE_INLINE void notify(size_t sid)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (doorbells[sid].sleeping.load(std::memory_order_relaxed))
+                ring(sid);
+        }
+
+        // Called by clients after publishing a message, the message is visible once the bit is
+        FORCE_INLINE void activate(size_t sid, size_t cid)
+        {
+            as_atomic(active_clients[sid][cid / 64]).fetch_or(1lu << (cid % 64), std::memory_order_release);
+        }
+
+        // Whole cache lines of the bitmap, so that empty lines are skipped with one test
+        size_t num_active_words() const
+        {
+            constexpr size_t WORDS_PER_LINE = CACHELINE_SIZE / sizeof(uint64_t);
+            return (num_clients + WORDS_PER_LINE * 64 - 1) / (WORDS_PER_LINE * 64) * WORDS_PER_LINE;
+        }
+
+        static bool is_zero_line(const uint64_t *line)
+        {
+#ifdef __AVX2__
+            auto bits = _mm256_or_si256(_mm256_load_si256((const __m256i *)line),
+                                        _mm256_load_si256((const __m256i *)line + 1));
+            return _mm256_testz_si256(bits, bits);
+#else
+            return !(line[0] | line[1] | line[2] | line[3] | line[4] | line[5] | line[6] | line[7]);
+#endif
+        }
+
+        bool has_active_client(size_t sid) const
+        {
+            for (size_t i = 0; i < num_active_words(); i += CACHELINE_SIZE / sizeof(uint64_t))
+            {
+                if (!is_zero_line(active_clients[sid] + i))
+                    return true;
+            }
+            return false;
+        }
+
+        // Takes the bits of all clients with new messages
+        template <typename FuncType> FORCE_INLINE void for_each_active_client(size_t sid, FuncType &&func)
+        {
+            auto bitmap = active_clients[sid];
+            for (size_t i = 0; i < num_active_words(); i += CACHELINE_SIZE / sizeof(uint64_t))
+            {
+                if (is_zero_line(bitmap + i))
+                    continue;
+                for (size_t j = i; j < i + CACHELINE_SIZE / sizeof(uint64_t); j++)
+                {
+                    if (!bitmap[j])
+                        continue;
+                    auto bits = as_atomic(bitmap[j]).exchange(0, std::memory_order_acquire);
+                    while (bits)
+                    {
+                        func(j * 64 + __builtin_ctzll(bits));
+                        bits &= bits - 1;
+                    }
+                }
+            }
+        }
+
+        void ring(size_t sid)
+        {
+            auto &doorbell = doorbells[sid];
+            doorbell.ring_time.store(io_stats_now(), std::memory_order_relaxed);
+            doorbell.seq.fetch_add(1);
+            syscall(SYS_futex, &doorbell.seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+        }
+
         template <typename CreateContextFuncType,
                   typename PreProcessFuncType,
                   typename FirstProcessFuncType,
                   typename ProcessFuncType,
-                  typename DestroyContextFuncType>
+                  typename DestroyContextFuncType,
+                  typename IdleFuncType,
+                  typename ResumeFuncType>
         void server_loop(size_t sid,
                          CreateContextFuncType create_context_func,
                          PreProcessFuncType pre_process_func,
                          FirstProcessFuncType first_process_func,
                          ProcessFuncType process_func,
-                         DestroyContextFuncType destroy_context_func)
+                         DestroyContextFuncType destroy_context_func,
+                         IdleFuncType idle_func,
+                         ResumeFuncType resume_func)
         {
             {
                 struct bitmask *mask = numa_bitmask_alloc(numa_num_possible_nodes());
@@ -227,6 +395,10 @@ namespace scache
             memset(requests[sid], 0, MAX_THREADS * sizeof(message_type));
             memset(responses[sid], 0, MAX_THREADS * sizeof(message_type));
 
+            // NUMA-local after numa_bind
+            active_clients[sid] = (uint64_t *)mmap_alloc(num_active_words() * sizeof(uint64_t), CACHELINE_SIZE);
+            memset(active_clients[sid], 0, num_active_words() * sizeof(uint64_t));
+
             {
                 cpu_set_t cpuset;
                 CPU_ZERO(&cpuset);
@@ -253,6 +425,11 @@ namespace scache
             num_ready_threads++;
 
             size_t count = 0;
+            size_t idle_loops = 0;
+            uint64_t idle_start = 0, idle_ns = 0;
+
+            std::vector<size_t> active_cids;
+            active_cids.reserve(num_clients);
 
             int num_async_processing[MAX_THREADS];
             memset(num_async_processing, 0, sizeof(num_async_processing));
@@ -328,18 +505,22 @@ namespace scache
             while (!is_stop)
             {
                 int left_async_processing = 0;
+                bool is_idle = true;
                 async_requests.clear();
 
-                for (size_t cid = 0; cid < num_clients; cid++)
-                {
-                    _mm_prefetch(&requests[sid][cid], _MM_HINT_T1);
-                }
+                active_cids.clear();
+                for_each_active_client(sid,
+                                       [&](size_t cid)
+                                       {
+                                           _mm_prefetch(&requests[sid][cid], _MM_HINT_T1);
+                                           active_cids.emplace_back(cid);
+                                       });
 
                 // spin_pause();
 
                 if constexpr (ENABLE_SERVER_PRE_PROCESSING)
                 {
-                    for (size_t cid = 0; cid < num_clients; cid++)
+                    for (auto cid : active_cids)
                     {
                         auto &message = requests[sid][cid];
                         if (message.header.toggle != toggles[cid])
@@ -356,7 +537,7 @@ namespace scache
 
                 // spin_pause();
 
-                for (size_t cid = 0; cid < num_clients; cid++)
+                for (auto cid : active_cids)
                 {
                     auto &message = requests[sid][cid];
                     auto &resp_message = resp_messages[cid];
@@ -373,6 +554,7 @@ namespace scache
                     if (has_message[cid])
                     {
                         has_message[cid] = false;
+                        is_idle = false;
                         count += message.header.num_comm;
                         resp_message.header = message.header;
                         for (uint8_t i = 0; i < message.header.num_comm; i++)
@@ -409,6 +591,47 @@ namespace scache
                     }
                 }
 
+                if constexpr (USING_FIBER_ASYNC_RESPONSE)
+                {
+                    resume_func(context,
+                                [&](const request_type &request, const async_context_type &request_context)
+                                {
+                                    is_idle = false;
+                                    num_async_fiber_processing++;
+                                    async_channel.push(std::make_tuple(request, request_context));
+                                });
+                }
+
+                bool has_background_work = false;
+                if (is_idle)
+                    has_background_work = idle_func(context);
+
+                if constexpr (ENABLE_SERVER_SLEEP)
+                {
+                    // The clock is read once every IDLE_CLOCK_INTERVAL idle loops
+                    if (!is_idle || has_background_work || num_async_fiber_processing)
+                    {
+                        idle_loops = 0;
+                        idle_ns = 0;
+                    }
+                    else if (idle_loops++ == 0)
+                    {
+                        idle_start = io_stats_now();
+                    }
+                    else if (idle_loops % IDLE_CLOCK_INTERVAL == 0)
+                    {
+                        idle_ns = io_stats_now() - idle_start;
+                        if (idle_ns >= idle_spin_ns + idle_pause_ns)
+                        {
+                            sleep(sid, [&]() { return is_stop || has_active_client(sid); });
+                            idle_loops = 0;
+                            idle_ns = 0;
+                        }
+                    }
+                    if (idle_ns >= idle_spin_ns)
+                        idle_pause();
+                }
+
                 if constexpr (USING_FIBER_ASYNC_RESPONSE)
                 {
                     if (num_async_fiber_processing)
@@ -446,14 +669,48 @@ namespace scache
             async_fiber.join();
 
             printf("Partition [%03lu] processes %lu operations\n", sid, count);
+            if constexpr (ENABLE_SERVER_SLEEP)
+            {
+                auto &stats = idle_stats[sid];
+                printf("Partition [%03lu] sleeps %lu times for %lf s, wake-up latency p50 %lu ns, p99 %lu ns\n", sid,
+                       stats.num_sleeps, stats.sleep_ns / 1e9, stats.wakeup_latency.get_percentile(0.5),
+                       stats.wakeup_latency.get_percentile(0.99));
+            }
         }
 
+        // Sleeps on the doorbell, unless wake_func finds work after announcing it
+        template <typename WakeFuncType> void sleep(size_t sid, WakeFuncType &&wake_func)
+        {
+            auto &doorbell = doorbells[sid];
+            auto &stats = idle_stats[sid];
+            auto seq = doorbell.seq.load();
+            doorbell.sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!wake_func())
+            {
+                auto start = io_stats_now();
+                timespec timeout = {0, SLEEP_TIMEOUT_NS};
+                syscall(SYS_futex, &doorbell.seq, FUTEX_WAIT_PRIVATE, seq, &timeout, nullptr, 0);
+                auto now = io_stats_now();
+                stats.num_sleeps++;
+                stats.sleep_ns += now - start;
+                auto ring_time = doorbell.ring_time.exchange(0, std::memory_order_relaxed);
+                if (ring_time && ring_time >= start)
+                    stats.wakeup_latency.record(now - ring_time);
+            }
+            doorbell.sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        constexpr static size_t IDLE_CLOCK_INTERVAL = 64;
+        constexpr static long SLEEP_TIMEOUT_NS = 100'000'000;
+
         std::vector<size_t> cpus, nodes;
 
         message_type *requests_pool[MAX_NUMANODES];
         message_type *requests[MAX_THREADS]; // requests[server_id][client_id]
         message_type *responses_pool[MAX_NUMANODES];
         message_type *responses[MAX_THREADS]; // responses[server_id][client_id]
+        uint64_t *active_clients[MAX_THREADS]; // active_clients[server_id], one bit per client with a new message
         std::vector<size_t> numa_threads[MAX_NUMANODES];
 
         std::vector<std::thread> threads;
@@ -464,6 +721,11 @@ namespace scache
         bool *client_toggles;
         std::mutex mutex;
 
+        std::unique_ptr<doorbell_type[]> doorbells;
+        std::vector<ServerIdleStats> idle_stats;
+        std::atomic_uint64_t idle_spin_ns;
+        std::atomic_uint64_t idle_pause_ns;
+
         bool is_stop;
         bool is_run;
     };
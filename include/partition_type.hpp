@@ -27,7 +27,8 @@ namespace scache
     constexpr size_t MAX_NUMANODES = 8;
     constexpr bool PURE_THREADING = true;
     constexpr size_t MAX_FIBERS_PER_THREAD = PURE_THREADING ? 1 : 16;
-    constexpr size_t MAX_CACHES = 1;
+    // IntegratedCache instances over the life of a process, see MemoryBudget to share memory among them
+    constexpr size_t MAX_CACHES = 8;
     constexpr size_t MESSAGE_SIZE = PURE_THREADING ? CACHELINE_SIZE * 1 : CACHELINE_SIZE * 2;
     constexpr bool USING_SINGLE_CACHELINE = false;
     constexpr bool USING_FIBER_ASYNC_RESPONSE = true; // PURE_THREADING ? false : true;
@@ -38,6 +39,28 @@ namespace scache
     constexpr bool ENABLE_DIRECT_PIN = true;
     constexpr bool ENABLE_DIRECT_UNPIN = true;
     constexpr bool ENABLE_IOPS_STATS = true;
+    constexpr bool ENABLE_BACKGROUND_CLEANER = true;
+    constexpr size_t CLEANER_LOW_WATERMARK = 32;
+    constexpr size_t CLEANER_HIGH_WATERMARK = 128;
+    constexpr size_t CLEANER_MAX_INFLIGHT = 64;
+    constexpr size_t MAX_DISCARD_BATCH = 4096;
+    // Pins of a loading page wait for its load, pins finding every page pinned wait for an unpin in a FIFO.
+    // With a pin timeout, pins waiting longer are answered without a page and the client fails with "oom".
+    constexpr bool ENABLE_PIN_WAITERS = USING_FIBER_ASYNC_RESPONSE;
+    constexpr uint64_t DEFAULT_PIN_TIMEOUT_NS = 0; // waits forever
+    // Idle server threads poll, then pause, then sleep until a client rings their doorbell
+    constexpr bool ENABLE_SERVER_SLEEP = true;
+    constexpr uint64_t DEFAULT_SERVER_SPIN_NS = 100'000;
+    constexpr uint64_t DEFAULT_SERVER_PAUSE_NS = 2'000'000;
+    // Partitions trade physical pages by their ghost hits, up to MAX_PARTITION_GROWTH times their share
+    // and down to 1 / MIN_PARTITION_SHARE_RATIO of it. Every partition holds frames for the growth, which backends
+    // registering their frames (io_uring registered, SPDK) allocate and lock, so these keep the even share unless
+    // ENABLE_REGISTERED_MEMORY_BALANCING is set.
+    constexpr bool ENABLE_MEMORY_BALANCING = true;
+    constexpr bool ENABLE_REGISTERED_MEMORY_BALANCING = false;
+    constexpr size_t MAX_PARTITION_GROWTH = 2;
+    constexpr size_t MIN_PARTITION_SHARE_RATIO = 4;
+    constexpr size_t MEMORY_BALANCE_BATCH = 1024;
 
     struct header_type
     {
@@ -60,6 +83,11 @@ namespace scache
             DirtyUnpin = 3,
             NotifyDirectPin = 4,
             NotifyDirectUnpin = 5,
+            Discard = 6,    // Drops resp->pointer consecutive pages of one group from page_id on
+            MigrateOut = 7, // Moves the pages of a group into the buffer in resp->pointer, holding their frames
+            MigrateIn = 8,  // Loads the pages of a group from the buffer in resp->pointer
+            SetCapacity = 9, // Resizes the partition to page_id physical pages
+            MigrateDone = 10, // Frees the frames held since MigrateOut
         } type;
         vpage_id_type page_id : (sizeof(vpage_id_type) * 8 - CACHE_PAGE_BITS);
         response_type *resp;
@@ -13,37 +13,423 @@
 // limitations under the License.
 
 #pragma once
+#include "partition_type.hpp"
 #include "type.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
 
 namespace scache
 {
-    class RoundRobinPartitioner
+    // Set with the CACHE_STRIPE_PAGES option of CMake
+#ifndef DEF_STRIPE_PAGES
+    constexpr size_t STRIPE_PAGES = 64;
+#else
+    constexpr size_t STRIPE_PAGES = DEF_STRIPE_PAGES;
+#endif
+    static_assert(STRIPE_PAGES > 0 && (STRIPE_PAGES & (STRIPE_PAGES - 1)) == 0,
+                  "Stripe must be a power-of-two number of pages");
+
+    // Deals stripes of StripePages consecutive vpages to partitions round-robin,
+    // the blocks of a stripe stay consecutive in its partition.
+    template <size_t StripePages> class StripedPartitioner
+    {
+    public:
+        StripedPartitioner(partition_id_type _num_partitions, vpage_id_type _num_vpages)
+            : num_partitions(_num_partitions), num_vpages(_num_vpages)
+        {
+        }
+
+        std::tuple<partition_id_type, block_id_type> operator()(vpage_id_type vpage_id) const
+        {
+            auto stripe_id = vpage_id / StripePages;
+            return {stripe_id % num_partitions, stripe_id / num_partitions * StripePages + vpage_id % StripePages};
+        }
+
+        block_id_type num_blocks(partition_id_type partition_id) const
+        {
+            auto round_pages = num_partitions * StripePages;
+            auto left_pages = num_vpages % round_pages;
+            auto partition_begin = partition_id * StripePages;
+            return num_vpages / round_pages * StripePages +
+                   (left_pages > partition_begin ? std::min(left_pages - partition_begin, StripePages) : 0);
+        }
+
+        vpage_id_type operator()(partition_id_type partition_id, block_id_type block_id) const
+        {
+            return (block_id / StripePages * num_partitions + partition_id) * StripePages + block_id % StripePages;
+        }
+
+    private:
+        const partition_id_type num_partitions;
+        const vpage_id_type num_vpages;
+    };
+
+    using RoundRobinPartitioner = StripedPartitioner<1>;
+
+    // Deals stripes like StripedPartitioner, but rotates every round of num_partitions stripes by a hash of the round,
+    // so that scans striding over whole rounds still spread over all partitions.
+    template <size_t StripePages> class HashedStripedPartitioner
     {
     public:
-        RoundRobinPartitioner(partition_id_type _num_partitions, vpage_id_type _num_vpages)
+        HashedStripedPartitioner(partition_id_type _num_partitions, vpage_id_type _num_vpages)
             : num_partitions(_num_partitions), num_vpages(_num_vpages)
         {
         }
 
         std::tuple<partition_id_type, block_id_type> operator()(vpage_id_type vpage_id) const
         {
-            return {vpage_id % num_partitions, vpage_id / num_partitions};
+            auto stripe_id = vpage_id / StripePages;
+            auto round = stripe_id / num_partitions;
+            return {(stripe_id + rotation(round)) % num_partitions, round * StripePages + vpage_id % StripePages};
         }
 
         block_id_type num_blocks(partition_id_type partition_id) const
         {
-            return num_vpages / num_partitions + (partition_id < num_vpages % num_partitions);
+            auto round_pages = num_partitions * StripePages;
+            auto num_rounds = num_vpages / round_pages;
+            auto left_pages = num_vpages % round_pages;
+            // Position of the partition in the last, partial round
+            auto partition_begin = position(partition_id, num_rounds) * StripePages;
+            return num_rounds * StripePages +
+                   (left_pages > partition_begin ? std::min(left_pages - partition_begin, StripePages) : 0);
         }
 
         vpage_id_type operator()(partition_id_type partition_id, block_id_type block_id) const
         {
-            return block_id * num_partitions + partition_id;
+            auto round = block_id / StripePages;
+            return (round * num_partitions + position(partition_id, round)) * StripePages + block_id % StripePages;
         }
 
     private:
+        partition_id_type rotation(size_t round) const { return (round * 0x9e3779b97f4a7c15lu >> 32) % num_partitions; }
+
+        partition_id_type position(partition_id_type partition_id, size_t round) const
+        {
+            return (partition_id + num_partitions - rotation(round)) % num_partitions;
+        }
+
         const partition_id_type num_partitions;
         const vpage_id_type num_vpages;
     };
 
+    constexpr bool ENABLE_STRIPE_HASHING = true;
+
+    // Vpage to partition mapping of SharedCache, also followed by PrivateCache. Stripes of STRIPE_PAGES (set with
+    // DEF_STRIPE_PAGES) keep scans within a few partitions, so their misses share messages.
+    using CachePartitioner = std::conditional_t<ENABLE_STRIPE_HASHING, HashedStripedPartitioner<STRIPE_PAGES>,
+                                                StripedPartitioner<STRIPE_PAGES>>;
+
+    constexpr bool ENABLE_HOT_GROUP_MIGRATION = true;
+    constexpr size_t HOT_GROUP_PAGES = 64;
+    // One spare group per SPARE_GROUP_RATIO home groups
+    constexpr size_t SPARE_GROUP_RATIO = 8;
+    // One request in LOAD_SAMPLE_INTERVAL is counted for its group
+    constexpr size_t LOAD_SAMPLE_INTERVAL = 8;
+    // Partitions within this ratio above the mean load are balanced
+    constexpr double LOAD_IMBALANCE_TOLERANCE = 0.1;
+
+    // Serves groups of HOT_GROUP_PAGES consecutive blocks of the base partitioner from any partition.
+    // The blocks of a partition are its home groups at their base position, followed by spare groups hosting
+    // the groups moved in from other partitions. Routes are changed by a single controller, see plan().
+    template <typename BasePartitioner> class SkewAwarePartitioner
+    {
+    public:
+        // 0 while a group is at home, otherwise owner + 1 in bits 32 ~ 62 and the spare slot below.
+        // MOVING is set while the pages of the group are in transit.
+        using route_type = uint64_t;
+        constexpr static route_type HOME = 0;
+        constexpr static route_type MOVING = 1lu << 63;
+
+        struct move_type
+        {
+            size_t group;
+            partition_id_type from, to;
+        };
+
+        SkewAwarePartitioner(const BasePartitioner &_base, partition_id_type _num_partitions)
+            : base(_base),
+              num_partitions(_num_partitions),
+              num_home_groups(0),
+              num_spare_groups(0),
+              routes(nullptr),
+              hits(nullptr),
+              loads(nullptr),
+              last_loads(num_partitions, 0),
+              free_slots(num_partitions)
+        {
+            for (partition_id_type sid = 0; sid < num_partitions; sid++)
+                num_home_groups =
+                    std::max<size_t>(num_home_groups, (base.num_blocks(sid) + HOT_GROUP_PAGES - 1) / HOT_GROUP_PAGES);
+            if constexpr (ENABLE_HOT_GROUP_MIGRATION)
+                num_spare_groups = std::max<size_t>(num_home_groups / SPARE_GROUP_RATIO, 1);
+
+            routes = (route_type *)mmap_alloc(num_groups() * sizeof(route_type));
+            memset((void *)routes, 0, num_groups() * sizeof(route_type));
+            hits = (uint32_t *)mmap_alloc(num_groups() * sizeof(uint32_t));
+            memset(hits, 0, num_groups() * sizeof(uint32_t));
+            loads = (cacheline_aligned_type<uint64_t> *)mmap_alloc(num_partitions * sizeof(*loads), CACHELINE_SIZE);
+            for (partition_id_type sid = 0; sid < num_partitions; sid++)
+                loads[sid]() = 0;
+            rebuild_free_slots();
+        }
+
+        SkewAwarePartitioner(const SkewAwarePartitioner &) = delete;
+        SkewAwarePartitioner(SkewAwarePartitioner &&) = delete;
+
+        ~SkewAwarePartitioner()
+        {
+            mmap_free(routes, num_groups() * sizeof(route_type));
+            mmap_free(hits, num_groups() * sizeof(uint32_t));
+            mmap_free(loads, num_partitions * sizeof(*loads));
+        }
+
+        // Waits while the group of vpage_id is moving
+        std::tuple<partition_id_type, block_id_type> operator()(vpage_id_type vpage_id) const
+        {
+            while (true)
+            {
+                auto [route, sid, block_id] = resolve(vpage_id);
+                if (!(route & MOVING))
+                    return {sid, block_id};
+                _mm_pause();
+            }
+        }
+
+        // Location under the current route, which may be MOVING
+        std::tuple<route_type, partition_id_type, block_id_type> resolve(vpage_id_type vpage_id) const
+        {
+            auto [home, block_id] = base(vpage_id);
+            auto route = get_route(home * num_home_groups + block_id / HOT_GROUP_PAGES);
+            auto target = route & ~MOVING;
+            if (target == HOME)
+                return {route, home, block_id};
+            return {route, (target >> 32) - 1,
+                    (num_home_groups + (target & 0xffffffff)) * HOT_GROUP_PAGES + block_id % HOT_GROUP_PAGES};
+        }
+
+        block_id_type num_blocks(partition_id_type partition_id) const
+        {
+            if constexpr (!ENABLE_HOT_GROUP_MIGRATION)
+                return base.num_blocks(partition_id);
+            return (num_home_groups + num_spare_groups) * HOT_GROUP_PAGES;
+        }
+
+        size_t num_groups() const { return num_partitions * num_home_groups; }
+
+        size_t group_of(vpage_id_type vpage_id) const
+        {
+            auto [home, block_id] = base(vpage_id);
+            return home * num_home_groups + block_id / HOT_GROUP_PAGES;
+        }
+
+        partition_id_type home_of(size_t group) const { return group / num_home_groups; }
+
+        vpage_id_type first_vpage(size_t group) const { return group_vpage(group, 0); }
+
+        // Vpage of the i-th block of the group
+        vpage_id_type group_vpage(size_t group, size_t i) const
+        {
+            return base(home_of(group), group % num_home_groups * HOT_GROUP_PAGES + i);
+        }
+
+        // Blocks of the group that hold vpages, the last home group of a partition may be partial
+        size_t group_size(size_t group) const
+        {
+            return std::min(HOT_GROUP_PAGES,
+                            base.num_blocks(home_of(group)) - group % num_home_groups * HOT_GROUP_PAGES);
+        }
+
+        route_type get_route(size_t group) const
+        {
+            return as_atomic(routes[group]).load(std::memory_order_acquire);
+        }
+
+        void set_route(size_t group, route_type route)
+        {
+            as_atomic(routes[group]).store(route, std::memory_order_release);
+        }
+
+        partition_id_type owner_of(size_t group) const
+        {
+            auto target = get_route(group) & ~MOVING;
+            return target == HOME ? home_of(group) : (target >> 32) - 1;
+        }
+
+        // Takes a spare slot of the target, nullopt if it has none left
+        std::optional<route_type> reserve(size_t group, partition_id_type to)
+        {
+            if (to == home_of(group))
+                return HOME;
+            if (free_slots[to].empty())
+                return std::nullopt;
+            auto slot = free_slots[to].back();
+            free_slots[to].pop_back();
+            return (route_type)(to + 1) << 32 | slot;
+        }
+
+        void release(route_type route)
+        {
+            route &= ~MOVING;
+            if (route != HOME)
+                free_slots[(route >> 32) - 1].emplace_back(route & 0xffffffff);
+        }
+
+        // Called by the server thread of sid for every request it serves
+        FORCE_INLINE void record(partition_id_type sid, vpage_id_type vpage_id)
+        {
+            // Single writer, read by the controller
+            auto load = loads[sid]() + 1;
+            as_atomic(loads[sid]()).store(load, std::memory_order_relaxed);
+            if (load % LOAD_SAMPLE_INTERVAL == 0)
+                as_atomic(hits[group_of(vpage_id)]).fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::vector<uint64_t> get_loads() const
+        {
+            std::vector<uint64_t> result(num_partitions);
+            for (partition_id_type sid = 0; sid < num_partitions; sid++)
+                result[sid] = as_atomic(loads[sid]()).load(std::memory_order_relaxed) - last_loads[sid];
+            return result;
+        }
+
+        // Busiest partition over the mean, on the requests since the last plan(), 1 when balanced
+        double get_load_imbalance() const
+        {
+            auto current = get_loads();
+            uint64_t sum = 0, max = 0;
+            for (auto load : current)
+            {
+                sum += load;
+                max = std::max(max, load);
+            }
+            return sum ? (double)max * num_partitions / sum : 1.0;
+        }
+
+        // Picks up to max_moves groups that narrow the gap between the busiest and the idlest partitions,
+        // then starts a new load window and halves the group counters.
+        std::vector<move_type> plan(size_t max_moves)
+        {
+            auto current = get_loads();
+            for (partition_id_type sid = 0; sid < num_partitions; sid++)
+                last_loads[sid] += current[sid];
+
+            std::vector<move_type> moves;
+            uint64_t sum = 0;
+            for (auto load : current)
+                sum += load;
+            auto mean = (double)sum / num_partitions;
+            while (ENABLE_HOT_GROUP_MIGRATION && moves.size() < max_moves && sum)
+            {
+                auto hot = std::max_element(current.begin(), current.end()) - current.begin();
+                auto cold = std::min_element(current.begin(), current.end()) - current.begin();
+                if (current[hot] <= mean * (1 + LOAD_IMBALANCE_TOLERANCE))
+                    break;
+
+                // The hottest group that still narrows the gap once moved
+                auto gap = current[hot] - current[cold];
+                size_t best = num_groups();
+                uint64_t best_load = 0;
+                for (size_t group = 0; group < num_groups(); group++)
+                {
+                    uint64_t load = as_atomic(hits[group]).load(std::memory_order_relaxed) * LOAD_SAMPLE_INTERVAL;
+                    if (load <= best_load || load >= gap || owner_of(group) != (partition_id_type)hot)
+                        continue;
+                    if (home_of(group) != (partition_id_type)cold && free_slots[cold].empty())
+                        continue;
+                    if (std::find_if(moves.begin(), moves.end(), [&](const move_type &move)
+                                     { return move.group == group; }) != moves.end())
+                        continue;
+                    best = group;
+                    best_load = load;
+                }
+                if (best == num_groups())
+                    break;
+
+                moves.push_back({best, (partition_id_type)hot, (partition_id_type)cold});
+                current[hot] -= best_load;
+                current[cold] += best_load;
+            }
+
+            for (size_t group = 0; group < num_groups(); group++)
+            {
+                auto &counter = as_atomic(hits[group]);
+                if (auto value = counter.load(std::memory_order_relaxed))
+                    counter.store(value / 2, std::memory_order_relaxed);
+            }
+            return moves;
+        }
+
+        // A missing file leaves every group at home
+        void load(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            auto ret = pread(fd, routes, num_groups() * sizeof(route_type), 0);
+            close(fd);
+            if (ret != (ssize_t)(num_groups() * sizeof(route_type)))
+                throw std::runtime_error("Invalid route table " + path);
+            rebuild_free_slots();
+        }
+
+        void store(const std::string &path) const
+        {
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw std::runtime_error("Open Route Table Error");
+            auto size = num_groups() * sizeof(route_type);
+            if (pwrite(fd, routes, size, 0) != (ssize_t)size || fsync(fd) != 0)
+            {
+                close(fd);
+                throw std::runtime_error("Write Route Table Error");
+            }
+            close(fd);
+        }
+
+    private:
+        void rebuild_free_slots()
+        {
+            std::vector<std::vector<bool>> used(num_partitions, std::vector<bool>(num_spare_groups, false));
+            for (size_t group = 0; group < num_groups(); group++)
+            {
+                auto route = routes[group] & ~MOVING;
+                if (route != HOME)
+                    used[(route >> 32) - 1][route & 0xffffffff] = true;
+            }
+            for (partition_id_type sid = 0; sid < num_partitions; sid++)
+            {
+                free_slots[sid].clear();
+                for (size_t slot = num_spare_groups; slot--;)
+                {
+                    if (!used[sid][slot])
+                        free_slots[sid].emplace_back(slot);
+                }
+            }
+        }
+
+        const BasePartitioner base;
+        const partition_id_type num_partitions;
+        size_t num_home_groups;
+        size_t num_spare_groups;
+        route_type *routes;
+        uint32_t *hits;
+        cacheline_aligned_type<uint64_t> *loads;
+        // Owned by the controller
+        std::vector<uint64_t> last_loads;
+        std::vector<std::vector<uint32_t>> free_slots;
+    };
+
 } // namespace scache
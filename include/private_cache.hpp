@@ -20,13 +20,18 @@
 #include "shared_single_thread_cache.hpp"
 #include "single_thread_cache.hpp"
 #include "type.hpp"
+#include <algorithm>
 #include <atomic>
 #include <boost/fiber/operations.hpp>
+#include <cassert>
+#include <exception>
+#include <hopscotch-map/include/tsl/hopscotch_map.h>
 #include <limits>
 #include <memory>
 #include <optional>
 #include <tuple>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace scache
@@ -44,6 +49,7 @@ namespace scache
         {
             PrivateCache *cache;
             size_t pid;
+            bool failed = false;
         };
 
         static bool evict_func(SharedCacheContext &async_context,
@@ -68,8 +74,33 @@ namespace scache
         {
             auto g = async_context.cache->counter.guard_miss();
             auto global_vpage_id = async_context.cache->shared_cache.partitioner(async_context.pid, vpage_id);
-            auto pointer =
-                async_context.cache->shared_cache.pin(global_vpage_id, async_context.cache->partition_client.get());
+            void *pointer = nullptr;
+            auto &batch_pins = async_context.cache->batch_pins;
+            if (!batch_pins.empty())
+            {
+                // Takes over the shared pin of pin_batch
+                auto iter = batch_pins.find(global_vpage_id);
+                if (iter != batch_pins.end())
+                {
+                    pointer = iter->second;
+                    batch_pins.erase(iter);
+                }
+            }
+            if (!pointer)
+            {
+                // The shared pin fails on OOM or I/O errors, pin() rethrows it once the private pin is undone
+                try
+                {
+                    pointer = async_context.cache->shared_cache.pin(global_vpage_id,
+                                                                    async_context.cache->partition_client.get());
+                }
+                catch (const std::runtime_error &)
+                {
+                    async_context.cache->load_error = std::current_exception();
+                    async_context.failed = true;
+                    return true;
+                }
+            }
             std::atomic_thread_fence(std::memory_order_acquire);
             state.pointer = pointer;
             // printf("Load %lu\n", vpage_id);
@@ -91,20 +122,19 @@ namespace scache
                                                                  decltype(&load_func)>;
 
     public:
-        PrivateCache(SharedCache &_shared_cache, const double occupy_ratio = 1.0)
+        PrivateCache(SharedCache &_shared_cache, const double _occupy_ratio = 1.0)
             : shared_cache(_shared_cache),
               partition_client(shared_cache.get_client_shared_ptr()),
-              num_local_ppages_per_partition(shared_cache.num_ppages_per_partition * occupy_ratio /
-                                             shared_cache.max_num_clients),
+              occupy_ratio(_occupy_ratio),
+              partition_share(shared_cache.partition_share.load(std::memory_order_relaxed)),
+              num_local_ppages_per_partition(local_ppages(partition_share)),
+              max_local_ppages_per_partition(local_ppages(
+                  std::max(shared_cache.max_phy_size / CACHE_PAGE_SIZE / shared_cache.num_partitions +
+                               (shared_cache.max_phy_size / CACHE_PAGE_SIZE % shared_cache.num_partitions != 0),
+                           partition_share))),
               actual_num_ppages_per_thread(num_local_ppages_per_partition * shared_cache.num_partitions)
         {
-            for (size_t i = 0; i < shared_cache.num_partitions; i++)
-            {
-                auto default_context = SharedCacheContext{this, i};
-                private_caches.emplace_back(std::make_unique<single_thread_cache_type>(
-                    shared_cache.partitioner.num_blocks(i), num_local_ppages_per_partition, evict_func, load_func,
-                    default_context));
-            }
+            create_caches();
         }
 
         PrivateCache(const PrivateCache &) = delete;
@@ -127,13 +157,7 @@ namespace scache
             }
             partition_client->wait();
             private_caches.clear();
-            for (size_t i = 0; i < shared_cache.num_partitions; i++)
-            {
-                auto default_context = SharedCacheContext{this, i};
-                private_caches.emplace_back(std::make_unique<single_thread_cache_type>(
-                    shared_cache.partitioner.num_blocks(i), num_local_ppages_per_partition, evict_func, load_func,
-                    default_context));
-            }
+            create_caches();
         }
 
         FORCE_INLINE void *pin(vpage_id_type vpage_id)
@@ -141,6 +165,7 @@ namespace scache
             auto g = counter.guard_access();
             if (vpage_id >= shared_cache.num_vpages)
                 throw std::runtime_error("Virtual Page ID Error");
+            check_share();
             auto [pid, shared_vpage_id] = shared_cache.partitioner(vpage_id);
             auto &cache = *private_caches[pid];
             single_thread_cache_type::context_type ret;
@@ -155,7 +180,9 @@ namespace scache
                 }
                 if (++retry_loops > (1 << 30))
                     throw std::runtime_error("oom");
-            } while (ret.ppage_id == single_thread_cache_type::context_type::EMPTY_PPAGE_ID);
+            } while (ret.ppage_id == single_thread_cache_type::context_type::EMPTY_PPAGE_ID && !ret.failed);
+            if (ret.failed)
+                std::rethrow_exception(std::exchange(load_error, nullptr));
             return ret.external_state->pointer;
         }
 
@@ -171,6 +198,57 @@ namespace scache
                 cache.process(ret);
                 nano_spin();
             }
+            // Left above a shrink by pinned pages
+            if (cache.get_capacity() > num_local_ppages_per_partition)
+                cache.set_capacity_now(num_local_ppages_per_partition);
+        }
+
+        // Misses of the private caches are pinned together in the shared cache first, and their private pins take
+        // over these shared pins. Nothing stays pinned if it throws.
+        void pin_batch(const vpage_id_type *vpage_ids, size_t num, void **pointers)
+        {
+            for (size_t i = 0; i < num; i++)
+            {
+                if (vpage_ids[i] >= shared_cache.num_vpages)
+                    throw std::runtime_error("Virtual Page ID Error");
+            }
+
+            std::vector<vpage_id_type> misses;
+            for (size_t i = 0; i < num; i++)
+            {
+                auto [pid, shared_vpage_id] = shared_cache.partitioner(vpage_ids[i]);
+                if (!private_caches[pid]->contains(shared_vpage_id))
+                    misses.emplace_back(vpage_ids[i]);
+            }
+            std::sort(misses.begin(), misses.end());
+            misses.erase(std::unique(misses.begin(), misses.end()), misses.end());
+
+            std::vector<void *> shared_pointers(misses.size());
+            shared_cache.pin_batch(misses.data(), misses.size(), shared_pointers.data(), partition_client.get());
+            for (size_t k = 0; k < misses.size(); k++)
+                batch_pins.emplace(misses[k], shared_pointers[k]);
+            size_t i = 0;
+            try
+            {
+                for (; i < num; i++)
+                    pointers[i] = pin(vpage_ids[i]);
+            }
+            catch (...)
+            {
+                // The shared pins not taken over are released, the private pins taken so far are dropped
+                for (const auto &[vpage_id, pointer] : batch_pins)
+                    shared_cache.unpin(vpage_id, false, partition_client.get());
+                batch_pins.clear();
+                unpin_batch(vpage_ids, i);
+                throw;
+            }
+            assert(batch_pins.empty());
+        }
+
+        void unpin_batch(const vpage_id_type *vpage_ids, size_t num, bool is_write = false)
+        {
+            for (size_t i = 0; i < num; i++)
+                unpin(vpage_ids[i], is_write);
         }
 
         FORCE_INLINE void get(uintptr_t addr, size_t size, void *data)
@@ -205,12 +283,43 @@ namespace scache
     private:
         FORCE_INLINE void check_addr(uintptr_t addr, size_t size) const { shared_cache.check_addr(addr, size); }
 
+        size_t local_ppages(size_t share) const { return share * occupy_ratio / shared_cache.max_num_clients; }
+
+        void create_caches()
+        {
+            for (size_t i = 0; i < shared_cache.num_partitions; i++)
+            {
+                auto default_context = SharedCacheContext{this, i};
+                private_caches.emplace_back(std::make_unique<single_thread_cache_type>(
+                    shared_cache.partitioner.num_blocks(i), max_local_ppages_per_partition, evict_func, load_func,
+                    default_context));
+                private_caches.back()->set_capacity_now(num_local_ppages_per_partition);
+            }
+        }
+
+        // Follows resize_physical of the shared cache, pinned pages are evicted by their unpins
+        FORCE_INLINE void check_share()
+        {
+            auto share = shared_cache.partition_share.load(std::memory_order_relaxed);
+            if (share == partition_share)
+                return;
+            partition_share = share;
+            num_local_ppages_per_partition = local_ppages(share);
+            for (auto &cache : private_caches)
+                cache->set_capacity_now(num_local_ppages_per_partition);
+        }
+
         SharedCache &shared_cache;
         std::shared_ptr<PartitionClient> partition_client;
-        const size_t num_local_ppages_per_partition;
+        const double occupy_ratio;
+        size_t partition_share;
+        size_t num_local_ppages_per_partition;
+        const size_t max_local_ppages_per_partition;
         const size_t actual_num_ppages_per_thread;
 
         std::vector<std::unique_ptr<single_thread_cache_type>> private_caches;
+        tsl::hopscotch_map<vpage_id_type, void *> batch_pins; // shared pins of pin_batch not taken over yet
+        std::exception_ptr load_error;                        // failed shared pin of load_func
 
         AccessCounter counter;
     };
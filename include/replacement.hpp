@@ -15,6 +15,7 @@
 #pragma once
 #include "type.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <boost/pool/pool_alloc.hpp>
 #include <list>
 
@@ -78,6 +79,18 @@ namespace scache
             }
         }
 
+        bool contains(const ppage_id_type &ppage_id) const { return states[ppage_id] != list.end(); }
+
+        // Visits up to max_num candidates in eviction order, stops when func returns false
+        template <typename FuncType> void scan(size_t max_num, FuncType &&func) const
+        {
+            for (auto iter = list.rbegin(); iter != list.rend() && max_num; ++iter, max_num--)
+            {
+                if (!func(*iter))
+                    return;
+            }
+        }
+
         ppage_id_type size() const { return list.size(); }
 
     private:
@@ -151,9 +164,29 @@ namespace scache
             }
         }
 
+        bool contains(const ppage_id_type &ppage_id) const { return states[ppage_id] != 0; }
+
+        // Visits up to max_num candidates from the hand, stops when func returns false
+        template <typename FuncType> void scan(size_t max_num, FuncType &&func) const
+        {
+            auto pos = hand;
+            auto max_steps = std::min(max_ppage_id, max_num * MAX_SCAN_STEPS_PER_CANDIDATE);
+            for (size_t steps = 0; steps < max_steps && max_num; steps++)
+            {
+                if (states[pos] != 0)
+                {
+                    max_num--;
+                    if (!func(pos))
+                        return;
+                }
+                pos = (pos + 1) % max_ppage_id;
+            }
+        }
+
         ppage_id_type size() const { return count; }
 
     private:
+        constexpr static size_t MAX_SCAN_STEPS_PER_CANDIDATE = 8;
         const ppage_id_type max_ppage_id;
         ppage_id_type hand;
         ppage_id_type count;
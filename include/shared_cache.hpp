@@ -16,6 +16,8 @@
 #include "access_counter.hpp"
 #include "compact_hash_page_table.hpp"
 #include "io_backend.hpp"
+#include "io_stats.hpp"
+#include "io_throttle.hpp"
 #include "memory_pool.hpp"
 #include "page_table.hpp"
 #include "partition_client.hpp"
@@ -25,16 +27,25 @@
 #include "replacement.hpp"
 #include "shared_single_thread_cache.hpp"
 #include "single_thread_cache.hpp"
+#include "superblock.hpp"
 #include "type.hpp"
+#include "zero_page.hpp"
+#include <algorithm>
 #include <boost/fiber/operations.hpp>
 #include <boost/thread.hpp>
 #include <chrono>
+#include <deque>
+#include <functional>
+#include <hopscotch-map/include/tsl/hopscotch_map.h>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <numa.h>
 #include <optional>
 #include <thread>
 #include <tuple>
 #include <type_traits>
+#include <unistd.h>
 #include <vector>
 
 namespace scache
@@ -53,6 +64,7 @@ namespace scache
             bool first = true;
             bool processing = false;
             bool finish = false;
+            bool failed = false;
         };
 
     public:
@@ -60,30 +72,233 @@ namespace scache
                     size_t _phy_size,
                     std::vector<size_t> _server_cpus,
                     std::vector<std::string> _server_paths,
-                    size_t _max_num_clients)
+                    size_t _max_num_clients,
+                    IOBackendType _io_backend = DEFAULT_IO_BACKEND,
+                    std::string _persist_path = "",
+                    size_t _max_phy_size = 0,
+                    IOScheduleConfig _io_schedule = IOScheduleConfig(),
+                    void *_frame_buffer = nullptr,
+                    bool _persist_recover = false)
             : virt_size(_virt_size),
               phy_size(_phy_size),
+              max_phy_size(std::max(_max_phy_size, _phy_size)),
               num_vpages(virt_size / CACHE_PAGE_SIZE),
               num_ppages(phy_size / CACHE_PAGE_SIZE),
               num_partitions(_server_cpus.size()),
               num_ppages_per_partition(num_ppages / num_partitions + (num_ppages % num_partitions != 0)),
+              max_ppages_per_partition(
+                  partition_frames(max_phy_size / CACHE_PAGE_SIZE, num_partitions, registers_frames(_io_backend))),
               actual_num_ppages_per_thread(num_ppages_per_partition * num_partitions / _max_num_clients),
               server_cpus(_server_cpus),
               server_paths(_server_paths),
               max_num_clients(_max_num_clients),
+              io_backend(_io_backend),
+              persist_path(_persist_path),
+              io_schedule(_io_schedule),
+              frame_buffer((uint8_t *)_frame_buffer),
+              persist_recover(_persist_recover),
+              reattached(false),
+              recovered(false),
               partitioner(num_partitions, num_vpages),
+              router(partitioner, num_partitions),
+              last_ghost_hits(num_partitions, 0),
+              cur_num_ppages(num_ppages),
+              partition_share(num_ppages_per_partition),
+              lost_writes(false),
+              pin_timeout_ns(DEFAULT_PIN_TIMEOUT_NS),
               server(server_cpus, max_num_clients),
               clients()
         {
-            if (virt_size < phy_size || virt_size % CACHE_PAGE_SIZE != 0 || phy_size % CACHE_PAGE_SIZE != 0 ||
-                server_cpus.empty())
+            if (virt_size < max_phy_size || virt_size % CACHE_PAGE_SIZE != 0 || phy_size % CACHE_PAGE_SIZE != 0 ||
+                max_phy_size % CACHE_PAGE_SIZE != 0 || server_cpus.empty())
                 throw std::runtime_error("Parameter Error");
+            if (!persist_path.empty())
+                attach_persistent();
             init_server();
         }
 
         SharedCache(const SharedCache &) = delete;
         SharedCache(SharedCache &&) = delete;
 
+        ~SharedCache()
+        {
+            if (persist_path.empty())
+                return;
+            // Server threads flush all pages before exiting
+            server.stop();
+            router.store(route_table_path());
+            auto superblock = Superblock::create(virt_size, num_partitions, PARTITIONER_ID);
+            // The next start refuses the backend then, its blocks may be stale
+            superblock.clean_shutdown = !lost_writes;
+            superblock.store(persist_path);
+        }
+
+        // Messages of the std::runtime_error thrown by failed pins
+        constexpr static const char *PIN_OOM_ERROR = "oom: every page of the partition stays pinned";
+        constexpr static const char *PIN_IO_ERROR = "I/O error: the page or its victim cannot be transferred";
+
+        // A pin started by pin_async(), which owns the page once resolved. The server writes the response into
+        // storage of the handle that stays in place, so the handle can be moved, e.g. kept in a vector.
+        // The destructor waits for the pin and unpins the page, unless unpin() or release() was called.
+        class PinHandle
+        {
+        public:
+            PinHandle()
+                : cache(nullptr), client(nullptr), sid(0), empty_since(0), req(), pointer(nullptr), pending(false),
+                  resp()
+            {
+            }
+            PinHandle(const PinHandle &) = delete;
+            PinHandle(PinHandle &&other) noexcept { take(other); }
+
+            PinHandle &operator=(PinHandle &&other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    take(other);
+                }
+                return *this;
+            }
+
+            ~PinHandle() { reset(); }
+
+            // Polls the partition without blocking, and resends the request if the group of the page moved
+            bool ready()
+            {
+                if (!pending)
+                    return true;
+                // Also sends requests queued after this one, such as the unpins a parked pin waits for
+                client->try_poll_message(sid, std::numeric_limits<size_t>::max());
+                auto answer = as_atomic((*resp)().pointer).load(std::memory_order_acquire);
+                if (!answer)
+                    return false;
+                if (reinterpret_cast<uintptr_t>(answer) == EMPTY_POINTER)
+                {
+                    if (cache->give_up_empty(empty_since))
+                    {
+                        pending = false;
+                        cache = nullptr;
+                        throw std::runtime_error(PIN_OOM_ERROR);
+                    }
+                    send();
+                    return false;
+                }
+                if (reinterpret_cast<uintptr_t>(answer) == REDIRECT_POINTER)
+                {
+                    sid = std::get<0>(cache->router(req.page_id));
+                    send();
+                    return false;
+                }
+                if (reinterpret_cast<uintptr_t>(answer) == IO_ERROR_POINTER)
+                {
+                    pending = false;
+                    cache = nullptr;
+                    throw std::runtime_error(PIN_IO_ERROR);
+                }
+                pointer = answer;
+                pending = false;
+                return true;
+            }
+
+            // Spins until the page is resident
+            void *get()
+            {
+                size_t loops = 0;
+                while (!ready())
+                    hybrid_spin(loops);
+                return pointer;
+            }
+
+            // Yields to the other fibers of this thread while waiting, so that each of them keeps a miss in flight
+            void *await()
+            {
+                while (!ready())
+                    boost::this_fiber::yield();
+                return pointer;
+            }
+
+            // Waits for the page and unpins it
+            void unpin(bool is_write = false)
+            {
+                get();
+                if (cache)
+                    cache->unpin(req.page_id, is_write, client);
+                cache = nullptr;
+            }
+
+            // Waits for the page and hands its pin over to the caller, who unpins it with SharedCache::unpin()
+            void *release()
+            {
+                auto page = get();
+                cache = nullptr;
+                return page;
+            }
+
+        private:
+            friend class SharedCache;
+
+            PinHandle(SharedCache *_cache, PartitionClient *_client, vpage_id_type vpage_id, void *_pointer)
+                : PinHandle()
+            {
+                cache = _cache;
+                client = _client;
+                req = {request_type::Type::Pin, vpage_id};
+                pointer = _pointer;
+                if (!pointer)
+                {
+                    sid = std::get<0>(cache->router(vpage_id));
+                    resp = std::make_unique<cacheline_aligned_type<scache::response_type>>();
+                    req.resp = &(*resp)();
+                    pending = true;
+                    send();
+                }
+            }
+
+            void send()
+            {
+                (*resp)() = {nullptr};
+                client->request(sid, req, &(*resp)());
+            }
+
+            void take(PinHandle &other)
+            {
+                cache = other.cache;
+                client = other.client;
+                sid = other.sid;
+                empty_since = other.empty_since;
+                req = other.req;
+                pointer = other.pointer;
+                pending = other.pending;
+                resp = std::move(other.resp);
+                other.cache = nullptr;
+                other.pending = false;
+            }
+
+            // A failed pin holds no page
+            void reset() noexcept
+            {
+                if (!cache)
+                    return;
+                try
+                {
+                    unpin();
+                }
+                catch (const std::runtime_error &)
+                {
+                }
+            }
+
+            SharedCache *cache; // nullptr without a pin to release
+            PartitionClient *client;
+            size_t sid;
+            uint64_t empty_since; // first answer without a page
+            scache::request_type req;
+            void *pointer;
+            bool pending; // the server may still write resp
+            std::unique_ptr<cacheline_aligned_type<scache::response_type>> resp;
+        };
+
         std::shared_ptr<PartitionClient> get_client_shared_ptr()
         {
             if (!clients.get())
@@ -107,23 +322,10 @@ namespace scache
 
             counter.count_access();
 
-            auto [sid, block_id] = partitioner(vpage_id);
-
             if constexpr (ENABLE_DIRECT_PIN)
             {
-                auto [success, ppage_id, pre_ref_count] = page_tables[sid]->pin(block_id);
-                if (success)
-                {
-                    if (pre_ref_count == 0)
-                    {
-                        if (!client)
-                            client = get_client();
-
-                        scache::request_type req = {request_type::Type::NotifyDirectPin, vpage_id};
-                        auto epoch = client->request(sid, req);
-                    }
-                    return phy_memory_pools[sid]->from_page_id(ppage_id);
-                }
+                if (auto pointer = direct_pin(vpage_id, client))
+                    return pointer;
             }
 
             if (!client)
@@ -133,9 +335,10 @@ namespace scache
             resp() = {nullptr};
             scache::request_type req = {request_type::Type::Pin, vpage_id, &resp()};
 
-            size_t retry_loops = 0;
+            uint64_t empty_since = 0;
             while (!resp().pointer)
             {
+                auto [sid, block_id] = router(vpage_id);
                 auto epoch = client->request(sid, req, &resp());
                 size_t loops = 0;
                 while (!resp().pointer)
@@ -145,21 +348,50 @@ namespace scache
                 }
                 if (reinterpret_cast<uintptr_t>(resp().pointer) == EMPTY_POINTER)
                 {
+                    if (give_up_empty(empty_since))
+                        throw std::runtime_error(PIN_OOM_ERROR);
                     resp() = {nullptr};
-                    nano_spin();
-                    if (++retry_loops > (1 << 20))
-                        throw std::runtime_error("oom");
+                }
+                else if (reinterpret_cast<uintptr_t>(resp().pointer) == REDIRECT_POINTER)
+                {
+                    // The group moved, routed again
+                    resp() = {nullptr};
+                }
+                else if (reinterpret_cast<uintptr_t>(resp().pointer) == IO_ERROR_POINTER)
+                {
+                    throw std::runtime_error(PIN_IO_ERROR);
                 }
             }
             return resp().pointer;
         }
 
+        // Starts a pin and returns at once. Hits resolve immediately, misses are sent to the partition and
+        // complete through PinHandle::ready(). The handle unpins the page, see PinHandle.
+        PinHandle pin_async(vpage_id_type vpage_id, PartitionClient *client = nullptr)
+        {
+            if (vpage_id >= num_vpages)
+                throw std::runtime_error("Virtual Page ID Error");
+
+            counter.count_access();
+
+            if (!client)
+                client = get_client();
+
+            if constexpr (ENABLE_DIRECT_PIN)
+            {
+                if (auto pointer = direct_pin(vpage_id, client))
+                    return PinHandle(this, client, vpage_id, pointer);
+            }
+            return PinHandle(this, client, vpage_id, nullptr);
+        }
+
         void unpin(vpage_id_type vpage_id, bool is_write = false, PartitionClient *client = nullptr)
         {
             if (vpage_id >= num_vpages)
                 throw std::runtime_error("Virtual Page ID Error");
 
-            auto [sid, block_id] = partitioner(vpage_id);
+            // A pinned page never moves, a MOVING route still names its owner
+            auto [route, sid, block_id] = router.resolve(vpage_id);
 
             if constexpr (ENABLE_DIRECT_UNPIN)
             {
@@ -188,6 +420,208 @@ namespace scache
             return;
         }
 
+        // Pins num pages at once: requests are grouped per partition to fill messages, and all misses are
+        // in flight together. Returns when every page is resident. On failure no page of the batch stays pinned.
+        // A batch needing more pages of a partition than its capacity fails at once, it would wait for itself.
+        void pin_batch(const vpage_id_type *vpage_ids, size_t num, void **pointers, PartitionClient *client = nullptr)
+        {
+            std::vector<std::pair<size_t, size_t>> misses; // (sid, index)
+            for (size_t i = 0; i < num; i++)
+            {
+                if (vpage_ids[i] >= num_vpages)
+                    throw std::runtime_error("Virtual Page ID Error");
+            }
+            if (!fits(vpage_ids, num))
+                throw std::runtime_error(PIN_OOM_ERROR);
+            for (size_t i = 0; i < num; i++)
+            {
+                counter.count_access();
+                pointers[i] = nullptr;
+
+                if constexpr (ENABLE_DIRECT_PIN)
+                {
+                    if ((pointers[i] = direct_pin(vpage_ids[i], client)))
+                        continue;
+                }
+                misses.emplace_back(std::get<0>(router(vpage_ids[i])), i);
+            }
+
+            if (misses.empty())
+                return;
+
+            if (!client)
+                client = get_client();
+
+            std::sort(misses.begin(), misses.end());
+            std::vector<response_type> resps(misses.size());
+            auto request = [&](size_t k)
+            {
+                auto [sid, i] = misses[k];
+                resps[k] = {nullptr};
+                scache::request_type req = {request_type::Type::Pin, vpage_ids[i], &resps[k]};
+                client->request(sid, req, &resps[k]);
+            };
+
+            for (size_t k = 0; k < misses.size(); k++)
+                request(k);
+            client->wait();
+
+            auto drop = [&](size_t i)
+            {
+                if (pointers[i])
+                    unpin(vpage_ids[i], false, client);
+                pointers[i] = nullptr;
+            };
+
+            // Failed pins are not sent again, the others are still waited for as the server writes their responses
+            std::vector<bool> done(misses.size(), false);
+            size_t num_left = misses.size(), loops = 0;
+            uint64_t empty_since = 0;
+            bool failed = false, io_failed = false;
+            while (num_left)
+            {
+                for (size_t k = 0; k < misses.size(); k++)
+                {
+                    auto [sid, i] = misses[k];
+                    if (done[k] || !resps[k].pointer)
+                        continue;
+                    if (reinterpret_cast<uintptr_t>(resps[k].pointer) == REDIRECT_POINTER)
+                    {
+                        misses[k].first = std::get<0>(router(vpage_ids[i]));
+                        request(k);
+                        continue;
+                    }
+                    bool was_failed = failed;
+                    if (reinterpret_cast<uintptr_t>(resps[k].pointer) == IO_ERROR_POINTER)
+                        failed = io_failed = true;
+                    else if (reinterpret_cast<uintptr_t>(resps[k].pointer) != EMPTY_POINTER)
+                        pointers[i] = resps[k].pointer;
+                    else if (!failed && !give_up_empty(empty_since))
+                    {
+                        request(k);
+                        continue;
+                    }
+                    else
+                        failed = true;
+                    done[k] = true;
+                    num_left--;
+                    // Pins parked behind the pages of a failed batch get them at once
+                    if (failed && !was_failed)
+                    {
+                        for (size_t j = 0; j < num; j++)
+                            drop(j);
+                    }
+                    else if (failed)
+                        drop(i);
+                }
+                if (num_left)
+                {
+                    hybrid_spin(loops);
+                    client->wait();
+                }
+            }
+
+            if (failed)
+                throw std::runtime_error(io_failed ? PIN_IO_ERROR : PIN_OOM_ERROR);
+        }
+
+        // Unpins num pages at once. Direct unpins come first, then the requests left are sent grouped per partition.
+        void unpin_batch(const vpage_id_type *vpage_ids,
+                         size_t num,
+                         bool is_write = false,
+                         PartitionClient *client = nullptr)
+        {
+            std::vector<std::pair<size_t, request_type>> requests; // (sid, request)
+            for (size_t i = 0; i < num; i++)
+            {
+                if (vpage_ids[i] >= num_vpages)
+                    throw std::runtime_error("Virtual Page ID Error");
+
+                auto [route, sid, block_id] = router.resolve(vpage_ids[i]);
+                if constexpr (ENABLE_DIRECT_UNPIN)
+                {
+                    if (page_tables[sid]->unpin(block_id, is_write) == 1)
+                        requests.emplace_back(sid, request_type{request_type::Type::NotifyDirectUnpin, vpage_ids[i]});
+                }
+                else
+                {
+                    requests.emplace_back(sid, request_type{is_write ? request_type::Type::DirtyUnpin
+                                                                     : request_type::Type::Unpin,
+                                                            vpage_ids[i]});
+                }
+            }
+
+            if (requests.empty())
+                return;
+
+            if (!client)
+                client = get_client();
+
+            std::stable_sort(requests.begin(), requests.end(),
+                             [](const auto &a, const auto &b) { return a.first < b.first; });
+            for (const auto &[sid, req] : requests)
+                client->request(sid, req);
+        }
+
+        // Drops the whole pages in [addr, addr + size) without write-back, they read as zeros afterwards.
+        // Pages pinned by any client, including those held by private caches, and pages busy with I/O are kept with
+        // their content, their number is returned. Returns once all partitions have processed the requests.
+        size_t discard(uintptr_t addr, size_t size, PartitionClient *client = nullptr)
+        {
+            vpage_id_type begin = (addr + CACHE_PAGE_SIZE - 1) >> CACHE_PAGE_BITS;
+            vpage_id_type end = std::min<vpage_id_type>((addr + size) >> CACHE_PAGE_BITS, num_vpages);
+            if (begin >= end)
+                return 0;
+
+            if (!client)
+                client = get_client();
+
+            // Consecutive blocks of one group go in one request, with their number in the response slot
+            std::vector<std::pair<vpage_id_type, size_t>> runs;
+            auto split = [&](vpage_id_type run_begin, vpage_id_type run_end)
+            {
+                for (auto vpage_id = run_begin; vpage_id < run_end;)
+                {
+                    auto [sid, block_id] = router(vpage_id);
+                    size_t num = 1;
+                    while (vpage_id + num < run_end && (block_id + num) % HOT_GROUP_PAGES != 0 &&
+                           router(vpage_id + num) == std::make_tuple(sid, block_id + num))
+                        num++;
+                    runs.emplace_back(vpage_id, num);
+                    vpage_id += num;
+                }
+            };
+            split(begin, end);
+
+            // Runs of a group moved meanwhile are answered with REDIRECT_POINTER and split again
+            size_t num_kept = 0;
+            std::vector<response_type> resps;
+            while (!runs.empty())
+            {
+                resps.resize(runs.size());
+                for (size_t k = 0; k < runs.size(); k++)
+                {
+                    resps[k].pointer = reinterpret_cast<void *>(runs[k].second);
+                    auto [sid, block_id] = router(runs[k].first);
+                    scache::request_type req = {request_type::Type::Discard, runs[k].first, &resps[k]};
+                    client->request(sid, req, &resps[k]);
+                }
+                client->wait();
+
+                auto sent = std::move(runs);
+                runs.clear();
+                for (size_t k = 0; k < sent.size(); k++)
+                {
+                    auto ret = reinterpret_cast<uintptr_t>(resps[k].pointer);
+                    if (ret == REDIRECT_POINTER)
+                        split(sent[k].first, sent[k].first + sent[k].second);
+                    else
+                        num_kept += ret - 1;
+                }
+            }
+            return num_kept;
+        }
+
         void get(uintptr_t addr, size_t size, void *data, PartitionClient *client = nullptr)
         {
             check_addr(addr, size);
@@ -222,8 +656,408 @@ namespace scache
 
         AccessCounter &get_access_counter() { return counter; }
 
+        IOBackendType get_io_backend() const { return io_backend; }
+
+        // Back-off of idle server threads, see PartitionServer::set_idle_policy
+        void set_server_idle_policy(uint64_t spin_ns, uint64_t pause_ns) { server.set_idle_policy(spin_ns, pause_ns); }
+
+        // Pins finding every page of their partition pinned fail with PIN_OOM_ERROR after timeout_ns, 0 waits until
+        // an unpin frees a frame
+        void set_pin_timeout(uint64_t timeout_ns) { pin_timeout_ns.store(timeout_ns, std::memory_order_relaxed); }
+
+        // Token-bucket limits of the whole cache and of every partition, enforced at I/O submission
+        void set_io_limit(const IOLimit &total, const IOLimit &per_partition)
+        {
+            shared_throttle.set_limit(total);
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                partition_throttles[sid].set_limit(per_partition);
+        }
+
+        bool is_persistent() const { return !persist_path.empty(); }
+
+        // Whether the cache serves the contents of a previous shutdown, clean or recovered
+        bool is_reattached() const { return reattached; }
+
+        // Whether the previous shutdown was not clean and the cache was started in recovery mode
+        bool is_recovered() const { return recovered; }
+
+        size_t get_num_partitions() const { return num_partitions; }
+
+        // Snapshot of the backend statistics of a partition, updated concurrently by its server thread
+        IOStats get_io_stats(size_t sid) const { return io_stats[sid]->snapshot(); }
+
+        IOStats get_io_stats() const
+        {
+            IOStats sum;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                sum.merge(io_stats[sid]->snapshot());
+            return sum;
+        }
+
+        // Busiest partition over the mean, on the requests since the last rebalance(), 1 when balanced
+        double get_load_imbalance() const { return router.get_load_imbalance(); }
+
+        // Moves up to max_groups hot page groups from the busiest partitions to the idlest ones and returns the number
+        // moved. Meant for a single controller thread, e.g. when get_load_imbalance() grows. Groups with pinned or
+        // absent pages, or without room in the target, stay where they are.
+        size_t rebalance(size_t max_groups = 8, PartitionClient *client = nullptr)
+        {
+            if constexpr (!ENABLE_HOT_GROUP_MIGRATION)
+                return 0;
+
+            std::lock_guard lock(rebalance_mutex);
+            if (!client)
+                client = get_client();
+
+            auto buffer = mmap_alloc(HOT_GROUP_PAGES * CACHE_PAGE_SIZE, CACHE_PAGE_SIZE);
+            std::vector<vpage_id_type> vpage_ids(HOT_GROUP_PAGES);
+            std::vector<void *> pointers(HOT_GROUP_PAGES);
+            size_t num_moved = 0;
+            for (auto [group, from, to] : router.plan(max_groups))
+            {
+                auto old_route = router.get_route(group);
+                auto vpage_id = router.first_vpage(group);
+                auto num = router.group_size(group);
+
+                // The target makes room without writing back, and the group is loaded by the owner's usual misses,
+                // so neither server reads or writes on its loop
+                if (!migrate(client, to, request_type::Type::MigrateIn, vpage_id, nullptr))
+                    continue;
+                for (size_t i = 0; i < num; i++)
+                    vpage_ids[i] = router.group_vpage(group, i);
+                try
+                {
+                    pin_batch(vpage_ids.data(), num, pointers.data(), client);
+                }
+                catch (const std::runtime_error &)
+                {
+                    continue;
+                }
+                unpin_batch(vpage_ids.data(), num, false, client);
+
+                auto new_route = router.reserve(group, to);
+                if (!new_route.has_value())
+                    continue;
+
+                // New pins wait from here, and pinned or evicted pages make the owner refuse to give the group away
+                router.set_route(group, old_route | router_type::MOVING);
+                if (!migrate(client, from, request_type::Type::MigrateOut, vpage_id, buffer))
+                {
+                    router.set_route(group, old_route);
+                    router.release(new_route.value());
+                    continue;
+                }
+
+                // The pages only exist in the buffer until a partition takes them. If the target filled its room
+                // meanwhile, they go back to the owner, which held their frames for that.
+                router.set_route(group, new_route.value() | router_type::MOVING);
+                if (migrate(client, to, request_type::Type::MigrateIn, vpage_id, buffer))
+                {
+                    router.set_route(group, new_route.value());
+                    router.release(old_route);
+                    migrate(client, from, request_type::Type::MigrateDone, vpage_id, nullptr);
+                    num_moved++;
+                    continue;
+                }
+                router.set_route(group, old_route | router_type::MOVING);
+                [[maybe_unused]] auto put_back = migrate(client, from, request_type::Type::MigrateIn, vpage_id, buffer);
+                assert(put_back);
+                router.set_route(group, old_route);
+                router.release(new_route.value());
+            }
+            mmap_free(buffer, HOT_GROUP_PAGES * CACHE_PAGE_SIZE);
+            return num_moved;
+        }
+
+        // Physical pages partition sid may use now
+        size_t get_capacity(size_t sid) const { return *capacities[sid]; }
+
+        // Current physical size, set by resize_physical
+        size_t get_phy_size() const { return cur_num_ppages * CACHE_PAGE_SIZE; }
+
+        size_t get_max_phy_size() const { return max_phy_size; }
+
+        // Bytes of the frame buffer to give the constructor, page aligned
+        static size_t frame_buffer_size(size_t phy_size, size_t max_phy_size, size_t num_partitions)
+        {
+            max_phy_size = std::max(max_phy_size, phy_size);
+            return partition_frames(max_phy_size / CACHE_PAGE_SIZE, num_partitions) * num_partitions * CACHE_PAGE_SIZE;
+        }
+
+        // Grows or shrinks the physical memory to new_phy_size (at most max_phy_size) while clients keep running.
+        // Partitions keep their proportions and are resized by MEMORY_BALANCE_BATCH pages at a time, shrinking ones
+        // first. progress(done, total) is called with the pages resized after every batch and once more on completion.
+        // Private caches shrink and grow along on their next pins. Pinned pages cannot be released, the size reached is
+        // returned. Frames registered by the backend (io_uring registered, SPDK) stay locked, so these cannot shrink.
+        size_t resize_physical(size_t new_phy_size,
+                               const std::function<void(size_t, size_t)> &progress = nullptr,
+                               PartitionClient *client = nullptr)
+        {
+            auto new_num_ppages = new_phy_size / CACHE_PAGE_SIZE;
+            if (new_phy_size % CACHE_PAGE_SIZE != 0 || new_phy_size > max_phy_size || new_num_ppages < num_partitions)
+                throw std::runtime_error("Parameter Error");
+
+            if (registers_frames(io_backend) && new_num_ppages < cur_num_ppages)
+                throw std::runtime_error("Frames registered by the IO backend cannot be released");
+
+            std::lock_guard lock(rebalance_mutex);
+            if (!client)
+                client = get_client();
+            auto share_of = [&](size_t num) { return num / num_partitions + (num % num_partitions != 0); };
+            partition_share = std::min(partition_share.load(), share_of(new_num_ppages));
+
+            std::vector<size_t> targets(num_partitions);
+            size_t old_num_ppages = 0, num_targets = 0;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                old_num_ppages += *capacities[sid];
+            for (size_t sid = 0; sid < num_partitions; sid++)
+            {
+                targets[sid] = std::clamp<size_t>(*capacities[sid] * new_num_ppages / old_num_ppages, 1,
+                                                  max_ppages_per_partition);
+                num_targets += targets[sid];
+            }
+            // Rounding leftovers
+            for (size_t sid = 0; num_targets < new_num_ppages; sid = (sid + 1) % num_partitions)
+            {
+                if (targets[sid] < max_ppages_per_partition)
+                {
+                    targets[sid]++;
+                    num_targets++;
+                }
+            }
+            while (num_targets > new_num_ppages)
+            {
+                (*std::max_element(targets.begin(), targets.end()))--;
+                num_targets--;
+            }
+
+            size_t done = 0, total = 0;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                total += std::max(targets[sid], *capacities[sid]) - std::min(targets[sid], *capacities[sid]);
+
+            auto resize = [&](bool shrink)
+            {
+                for (bool more = true; more;)
+                {
+                    more = false;
+                    for (size_t sid = 0; sid < num_partitions; sid++)
+                    {
+                        auto capacity = *capacities[sid];
+                        if (shrink ? capacity <= targets[sid] : capacity >= targets[sid])
+                            continue;
+                        auto next = shrink ? std::max(targets[sid], capacity - std::min(capacity, MEMORY_BALANCE_BATCH))
+                                           : std::min(targets[sid], capacity + MEMORY_BALANCE_BATCH);
+                        auto settled = send_capacity(client, sid, next);
+                        auto reached = *capacities[sid];
+                        if (reached == capacity && !settled)
+                        {
+                            std::this_thread::sleep_for(std::chrono::microseconds(50));
+                            more = true;
+                            continue;
+                        }
+                        if (reached == capacity)
+                        {
+                            // Held by pinned pages
+                            total -= capacity - targets[sid];
+                            targets[sid] = capacity;
+                            continue;
+                        }
+                        done += shrink ? capacity - reached : reached - capacity;
+                        more = true;
+                        if (progress)
+                            progress(done, total);
+                    }
+                }
+            };
+
+            resize(true);
+            // Shrinks left short take from the growth
+            size_t num_left = new_num_ppages;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                num_left -= std::min(num_left, std::min(targets[sid], *capacities[sid]));
+            for (size_t sid = 0; sid < num_partitions; sid++)
+            {
+                if (targets[sid] <= *capacities[sid])
+                    continue;
+                auto grow = std::min(targets[sid] - *capacities[sid], num_left);
+                total -= targets[sid] - *capacities[sid] - grow;
+                targets[sid] = *capacities[sid] + grow;
+                num_left -= grow;
+            }
+            resize(false);
+
+            size_t reached = 0;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                reached += *capacities[sid];
+            cur_num_ppages = reached;
+            partition_share = share_of(reached);
+            if (progress)
+                progress(done, total);
+            return reached * CACHE_PAGE_SIZE;
+        }
+
+        // Moves up to max_pages physical pages to the partition with the most ghost hits since the last call, from the
+        // one with the fewest, preferably on the same NUMA node. A move is made only if the donor had at most half the
+        // ghost hits of the receiver. Meant for the controller thread calling rebalance(), returns the pages moved.
+        size_t rebalance_memory(size_t max_pages = MEMORY_BALANCE_BATCH, PartitionClient *client = nullptr)
+        {
+            if (!ENABLE_MEMORY_BALANCING || num_partitions < 2)
+                return 0;
+
+            std::lock_guard lock(rebalance_mutex);
+            if (!client)
+                client = get_client();
+
+            std::vector<size_t> ghost_hits(num_partitions);
+            for (size_t sid = 0; sid < num_partitions; sid++)
+            {
+                auto hits = eviction_stats[sid]->num_ghost_hits;
+                ghost_hits[sid] = hits - last_ghost_hits[sid];
+                last_ghost_hits[sid] = hits;
+            }
+
+            size_t to = num_partitions;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+            {
+                if (*capacities[sid] >= max_ppages_per_partition)
+                    continue;
+                if (to == num_partitions || ghost_hits[sid] > ghost_hits[to])
+                    to = sid;
+            }
+            if (to == num_partitions || !ghost_hits[to])
+                return 0;
+
+            auto min_capacity = std::max<size_t>(cur_num_ppages / num_partitions / MIN_PARTITION_SHARE_RATIO, 1);
+            auto pick_donor = [&](bool same_node)
+            {
+                size_t from = num_partitions;
+                for (size_t sid = 0; sid < num_partitions; sid++)
+                {
+                    if (sid == to || *capacities[sid] <= min_capacity)
+                        continue;
+                    if (same_node && numa_node_of_cpu(server_cpus[sid]) != numa_node_of_cpu(server_cpus[to]))
+                        continue;
+                    if (from == num_partitions || ghost_hits[sid] < ghost_hits[from])
+                        from = sid;
+                }
+                return from;
+            };
+            auto worth = [&](size_t from) { return from < num_partitions && ghost_hits[from] * 2 <= ghost_hits[to]; };
+            auto from = pick_donor(true);
+            if (!worth(from))
+                from = pick_donor(false);
+            if (!worth(from))
+                return 0;
+
+            // The receiver only grows by what the donor gave up, the total stays within the budget
+            auto old_capacity = *capacities[from];
+            auto num = std::min({max_pages, old_capacity - min_capacity, max_ppages_per_partition - *capacities[to]});
+            send_capacity(client, from, old_capacity - num);
+            if (*capacities[from] >= old_capacity)
+                return 0;
+            num = old_capacity - *capacities[from];
+            send_capacity(client, to, *capacities[to] + num);
+            return num;
+        }
+
+        EvictionStats get_eviction_stats() const
+        {
+            EvictionStats sum;
+            for (size_t sid = 0; sid < num_partitions; sid++)
+            {
+                sum.num_evictions += eviction_stats[sid]->num_evictions;
+                sum.num_dirty_evictions += eviction_stats[sid]->num_dirty_evictions;
+                sum.num_cleaned += eviction_stats[sid]->num_cleaned;
+                sum.num_discarded += eviction_stats[sid]->num_discarded;
+                sum.num_misses += eviction_stats[sid]->num_misses;
+                sum.num_ghost_hits += eviction_stats[sid]->num_ghost_hits;
+            }
+            return sum;
+        }
+
     private:
         void init_server()
+        {
+            switch (io_backend)
+            {
+            case IOBackendType::Dummy:
+                init_server<DummyIO>();
+                break;
+            case IOBackendType::MemCopy:
+                init_server<MemCopy>();
+                break;
+            case IOBackendType::AIO:
+                init_server<AIO>();
+                break;
+#ifdef ENABLE_URING
+            case IOBackendType::IOURing:
+                init_server<IOURing>();
+                break;
+            case IOBackendType::IOURingRegistered:
+                init_server<IOURingRegistered>();
+                break;
+            case IOBackendType::IOURingSQPoll:
+                init_server<IOURingSQPoll>();
+                break;
+            case IOBackendType::IOURingIOPoll:
+                init_server<IOURingIOPoll>();
+                break;
+#else
+            case IOBackendType::IOURing:
+            case IOBackendType::IOURingRegistered:
+            case IOBackendType::IOURingSQPoll:
+            case IOBackendType::IOURingIOPoll:
+                throw std::runtime_error("IOURing backend is not enabled");
+#endif
+            case IOBackendType::SSDEmulator:
+                init_server<SSDEmulator>();
+                break;
+            case IOBackendType::SPDK:
+#ifdef ENABLE_SPDK
+                init_server<SPDK>();
+                break;
+#else
+                throw std::runtime_error("SPDK backend is not enabled");
+#endif
+            }
+        }
+
+        void attach_persistent()
+        {
+            if (io_backend == IOBackendType::Dummy || io_backend == IOBackendType::MemCopy)
+                throw std::runtime_error("Persistent mode requires a storage backend");
+
+            auto superblock = Superblock::create(virt_size, num_partitions, PARTITIONER_ID);
+            auto old_superblock = Superblock::load(persist_path);
+            if (old_superblock.has_value())
+            {
+                if (!old_superblock->clean_shutdown && !persist_recover)
+                    throw std::runtime_error("Persistent cache was not shut down cleanly, start it in recovery mode");
+                if (!old_superblock->same_layout(superblock))
+                    throw std::runtime_error("Persistent cache layout mismatch");
+                reattached = true;
+                // The backing stores keep what was written back before the crash, with the routes of the last clean
+                // shutdown. The zero block map of that shutdown is dropped, every block is read from the backend.
+                recovered = !old_superblock->clean_shutdown;
+                if (recovered)
+                    fprintf(stderr, "Recovering persistent cache %s after an unclean shutdown\n", persist_path.c_str());
+                router.load(route_table_path());
+            }
+
+            for (const auto &path : server_paths)
+            {
+                auto file = path.substr(0, path.find(','));
+                if (io_backend == IOBackendType::SSDEmulator && file == "mem")
+                    throw std::runtime_error("Persistent mode requires a storage backend");
+                if (reattached && io_backend != IOBackendType::SPDK && access(file.c_str(), F_OK) != 0)
+                    throw std::runtime_error("Missing backing file " + file);
+            }
+
+            // Marked clean again by the destructor
+            superblock.store(persist_path);
+        }
+
+        template <typename IOBackend> void init_server()
         {
             struct IOPS_Stats
             {
@@ -233,11 +1067,38 @@ namespace scache
 
             auto create_context = [&](size_t sid) FORCE_INLINE
             {
-                auto virt_io_backend =
-                    std::make_shared<SPDK>(server_paths[sid], partitioner.num_blocks(sid), num_ppages_per_partition);
+                std::shared_ptr<IOBackend> virt_io_backend;
+                if constexpr (std::is_constructible_v<IOBackend, std::string, block_id_type, ppage_id_type, bool,
+                                                      IOScheduleConfig>)
+                    virt_io_backend = std::make_shared<IOBackend>(server_paths[sid], router.num_blocks(sid),
+                                                                  max_ppages_per_partition, is_persistent(),
+                                                                  io_schedule);
+                else if constexpr (std::is_constructible_v<IOBackend, std::string, block_id_type, ppage_id_type,
+                                                           IOScheduleConfig>)
+                    virt_io_backend = std::make_shared<IOBackend>(server_paths[sid], router.num_blocks(sid),
+                                                                  max_ppages_per_partition, io_schedule);
+                else
+                    virt_io_backend = std::make_shared<IOBackend>(server_paths[sid], router.num_blocks(sid),
+                                                                  max_ppages_per_partition);
+                auto buffer = virt_io_backend->get_buffer();
+                if (frame_buffer)
+                {
+                    if (buffer)
+                        throw std::runtime_error("IO backend does not support external frames");
+                    buffer = frame_buffer + sid * max_ppages_per_partition * CACHE_PAGE_SIZE;
+                }
+                // Frames of the caller, e.g. shared memory, can be released, those registered by the backend cannot
                 auto phy_memory_pool =
-                    std::make_shared<MemoryPool>(num_ppages_per_partition, virt_io_backend->get_buffer());
+                    std::make_shared<MemoryPool>(max_ppages_per_partition, buffer, reattached, frame_buffer != nullptr);
                 phy_memory_pools[sid] = phy_memory_pool.get();
+                io_stats[sid] = &virt_io_backend->get_stats();
+                virt_io_backend->set_throttle(&partition_throttles[sid], &shared_throttle);
+                auto zero_blocks = std::make_shared<ZeroBlockMap>(router.num_blocks(sid));
+                if (reattached && !recovered)
+                    zero_blocks->load(zero_block_map_path(sid));
+                auto pending_discards = std::make_shared<std::vector<block_id_type>>();
+                // Keyed by pages being loaded by a pin, holding the responses of later pins of the same page
+                auto pin_waiters = std::make_shared<tsl::hopscotch_map<block_id_type, std::vector<response_type *>>>();
 
                 auto iops_stats =
                     std::make_shared<IOPS_Stats>(IOPS_Stats{std::chrono::high_resolution_clock::now(), 0lu, 0lu});
@@ -250,21 +1111,27 @@ namespace scache
                     if (async_context.first)
                     {
                         async_context.first = false;
+                        // The stale block on the backend is never read while the bit is set
+                        if (ENABLE_ZERO_PAGE_ELISION && is_zero_page(phy_memory_pool->from_page_id(ppage_id)))
+                        {
+                            zero_blocks->set(vpage_id);
+                            zero_blocks->num_elided_writes++;
+                            return true;
+                        }
+                        zero_blocks->reset(vpage_id);
                         return false;
                     }
                     if (!async_context.processing)
                     {
-                        auto ret = virt_io_backend->write(vpage_id, phy_memory_pool->from_page_id(ppage_id),
-                                                          &async_context.finish);
-                        while (!ret)
-                        {
-                            ret = virt_io_backend->write(vpage_id, phy_memory_pool->from_page_id(ppage_id),
-                                                         &async_context.finish);
-                        }
-                        async_context.processing = ret;
+                        // Retried by the next call if the backend queue is full
+                        async_context.processing =
+                            virt_io_backend->write(vpage_id, phy_memory_pool->from_page_id(ppage_id),
+                                                   &async_context.finish, &async_context.failed);
                         // virt_io_backend->progress();
                         return false;
                     }
+                    if (async_context.failed)
+                        return true;
                     if (!async_context.finish)
                     {
                         virt_io_backend->progress();
@@ -298,6 +1165,14 @@ namespace scache
                 {
                     if (!phy_memory_pool->loaded(ppage_id))
                         return true;
+                    // Zero pages and discarded blocks
+                    if (async_context.first && zero_blocks->test(vpage_id))
+                    {
+                        memset(phy_memory_pool->from_page_id(ppage_id), 0, CACHE_PAGE_SIZE);
+                        zero_blocks->num_elided_reads++;
+                        counter.count_miss();
+                        return true;
+                    }
                     if (async_context.first)
                     {
                         async_context.first = false;
@@ -305,17 +1180,14 @@ namespace scache
                     }
                     if (!async_context.processing)
                     {
-                        auto ret = virt_io_backend->read(vpage_id, phy_memory_pool->from_page_id(ppage_id),
-                                                         &async_context.finish);
-                        while (!ret)
-                        {
-                            ret = virt_io_backend->read(vpage_id, phy_memory_pool->from_page_id(ppage_id),
-                                                        &async_context.finish);
-                        }
-                        async_context.processing = ret;
+                        async_context.processing =
+                            virt_io_backend->read(vpage_id, phy_memory_pool->from_page_id(ppage_id),
+                                                  &async_context.finish, &async_context.failed);
                         // virt_io_backend->progress();
                         return false;
                     }
+                    if (async_context.failed)
+                        return true;
                     if (!async_context.finish)
                     {
                         virt_io_backend->progress();
@@ -352,38 +1224,178 @@ namespace scache
 
                 auto single_thread_cache = std::make_shared<
                     SharedSingleThreadCache<Clock, IOContext, EmptyState, decltype(evict_func), decltype(load_func)>>(
-                    partitioner.num_blocks(sid), num_ppages_per_partition, evict_func, load_func);
+                    router.num_blocks(sid), max_ppages_per_partition, evict_func, load_func);
+                // Starts at the even share
+                single_thread_cache->set_capacity(num_ppages_per_partition, [](ppage_id_type) {}, 0);
+                capacities[sid] = &single_thread_cache->capacity;
 
                 page_tables[sid] = &single_thread_cache->page_table;
+                eviction_stats[sid] = &single_thread_cache->get_stats();
+
+                auto parked_pins = std::make_shared<ParkedPins<
+                    typename std::decay_t<decltype(*single_thread_cache)>::context_type>>();
+
+                return std::make_tuple(phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks,
+                                       pending_discards, pin_waiters, parked_pins, sid);
+            };
+
+            // Blocks written since they were discarded have their zero bits reset, and are skipped
+            auto discard_func = [&](auto &context)
+            {
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                pending_discards->erase(std::remove_if(pending_discards->begin(), pending_discards->end(),
+                                                       [&](block_id_type block_id)
+                                                       { return !zero_blocks->test(block_id); }),
+                                        pending_discards->end());
+                if (!pending_discards->empty())
+                    virt_io_backend->discard(*pending_discards);
+                pending_discards->clear();
+            };
+
+            // The loading pin still holds the page, so every waiter pins it without blocking. If the load failed, they
+            // fail along.
+            auto wake_pin_waiters = [&](auto &context, block_id_type vpage_id, bool failed)
+            {
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                using req_context_type = typename std::decay_t<decltype(*single_thread_cache)>::context_type;
+                if (!pin_waiters->count(vpage_id))
+                    return;
+                auto waiters = std::move(pin_waiters->at(vpage_id));
+                pin_waiters->erase(vpage_id);
+                for (auto resp : waiters)
+                {
+                    if (failed)
+                    {
+                        resp->pointer = reinterpret_cast<void *>(IO_ERROR_POINTER);
+                        continue;
+                    }
+                    auto ret = single_thread_cache->pin(vpage_id);
+                    assert(ret.phase == req_context_type::Phase::End);
+                    resp->pointer = phy_memory_pool->from_page_id(ret.ppage_id);
+                }
+            };
 
-                return std::make_tuple(phy_memory_pool, virt_io_backend, single_thread_cache);
+            // Parked pins take the pages unpinned since in arrival order, misses are resumed to load them
+            auto wake_parked_pins = [&](auto &context)
+            {
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                using req_context_type = typename std::decay_t<decltype(*single_thread_cache)>::context_type;
+                auto &waiting = parked_pins->waiting;
+                while (!waiting.empty() && !single_thread_cache->full_pin())
+                {
+                    auto req = waiting.front().first;
+                    waiting.pop_front();
+                    auto [route, sid, vpage_id] = router.resolve(req.page_id);
+                    if constexpr (ENABLE_HOT_GROUP_MIGRATION)
+                    {
+                        if (sid != partition_id || (route & router_type::MOVING))
+                        {
+                            req.resp->pointer = reinterpret_cast<void *>(REDIRECT_POINTER);
+                            continue;
+                        }
+                    }
+                    auto ret = single_thread_cache->pin(vpage_id);
+                    if (ret.phase == req_context_type::Phase::End)
+                    {
+                        req.resp->pointer = pin_answer(phy_memory_pool, ret);
+                        continue;
+                    }
+                    if (ret.phase == req_context_type::Phase::Begin && pin_waiters->count(vpage_id))
+                    {
+                        pin_waiters->at(vpage_id).emplace_back(req.resp);
+                        continue;
+                    }
+                    if (ret.phase != req_context_type::Phase::Begin)
+                        pin_waiters->try_emplace(vpage_id);
+                    parked_pins->resumed.emplace_back(req, ret);
+                }
             };
 
             auto pre_processing_func = [&](auto &context, const scache::request_type &req) FORCE_INLINE
             {
-                auto &[phy_memory_pool, virt_io_backend, single_thread_cache] = context;
-                auto [sid, vpage_id] = partitioner(req.page_id);
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                if (req.type == request_type::Type::SetCapacity)
+                    return;
+                auto [route, sid, vpage_id] = router.resolve(req.page_id);
                 single_thread_cache->prefetch(vpage_id);
             };
 
-            auto first_processing_func =
-                [&](auto &context, const scache::request_type &req, scache::response_type &resp) FORCE_INLINE
+            // The helpers are copied, the server threads outlive this frame
+            auto first_processing_func = [&, discard_func, wake_pin_waiters](auto &context,
+                                                                             const scache::request_type &req,
+                                                                             scache::response_type &resp) FORCE_INLINE
             {
-                auto &[phy_memory_pool, virt_io_backend, single_thread_cache] = context;
-                auto [sid, vpage_id] = partitioner(req.page_id);
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
                 using req_context_type = typename std::decay_t<decltype(*single_thread_cache)>::context_type;
                 resp.pointer = nullptr;
+                if (req.type == request_type::Type::SetCapacity)
+                {
+                    // Freed frames may be reused for blocks written back meanwhile, so none is taken as never loaded
+                    phy_memory_pool->mark_loaded(0, max_ppages_per_partition);
+                    auto reached = single_thread_cache->set_capacity(
+                        req.page_id, [&](ppage_id_type ppage_id) { phy_memory_pool->release(ppage_id); },
+                        CLEANER_MAX_INFLIGHT);
+                    // Asked again once the dirty victims are written back
+                    resp.pointer = reached > req.page_id && single_thread_cache->cleaning()
+                                       ? reinterpret_cast<void *>(EMPTY_POINTER)
+                                       : (void *)1;
+                    return std::optional<req_context_type>{};
+                }
+                auto [route, sid, vpage_id] = router.resolve(req.page_id);
+                if constexpr (ENABLE_HOT_GROUP_MIGRATION)
+                {
+                    if (req.type == request_type::Type::Pin || req.type == request_type::Type::Discard)
+                    {
+                        // Sent on a route changed meanwhile, the client routes it again
+                        if (sid != partition_id || (route & router_type::MOVING))
+                        {
+                            resp.pointer = reinterpret_cast<void *>(REDIRECT_POINTER);
+                            return std::optional<req_context_type>{};
+                        }
+                    }
+                    // Client requests
+                    if (req.type <= request_type::Type::Discard)
+                        router.record(partition_id, req.page_id);
+                }
                 switch (req.type)
                 {
                 case request_type::Type::Pin:
                 {
                     auto ret = single_thread_cache->pin(vpage_id);
+                    if constexpr (ENABLE_PIN_WAITERS)
+                    {
+                        if (ret.phase == req_context_type::Phase::Begin)
+                        {
+                            // Answered together with the pin loading the page
+                            if (req.resp != nullptr && pin_waiters->count(vpage_id))
+                            {
+                                pin_waiters->at(vpage_id).emplace_back(req.resp);
+                                break;
+                            }
+                        }
+                        else if (ret.phase != req_context_type::Phase::End)
+                        {
+                            pin_waiters->try_emplace(vpage_id);
+                        }
+                        else if (ret.failed)
+                        {
+                            wake_pin_waiters(context, vpage_id, true);
+                        }
+                        else if (ret.ppage_id == req_context_type::EMPTY_PPAGE_ID && req.resp != nullptr)
+                        {
+                            // Every page is pinned, answered by an unpin or the timeout
+                            parked_pins->waiting.emplace_back(req, io_stats_now());
+                            break;
+                        }
+                    }
                     if (ret.phase != req_context_type::Phase::End)
                         return std::make_optional(ret);
-                    if (ret.ppage_id == req_context_type::EMPTY_PPAGE_ID)
-                        resp.pointer = reinterpret_cast<void *>(EMPTY_POINTER);
-                    else
-                        resp.pointer = phy_memory_pool->from_page_id(ret.ppage_id);
+                    resp.pointer = pin_answer(phy_memory_pool, ret);
                     break;
                 }
                 case request_type::Type::Unpin:
@@ -414,6 +1426,84 @@ namespace scache
                     resp.pointer = (void *)1;
                     break;
                 }
+                case request_type::Type::Discard:
+                {
+                    // Consecutive blocks of the group, their number comes in the response slot. Answered with one
+                    // more than the number of pages kept.
+                    auto num = reinterpret_cast<uintptr_t>(req.resp->pointer);
+                    size_t num_kept = 0;
+                    for (size_t i = 0; i < num; i++)
+                    {
+                        if (!single_thread_cache->discard(vpage_id + i))
+                        {
+                            num_kept++;
+                            continue;
+                        }
+                        zero_blocks->set(vpage_id + i);
+                        pending_discards->push_back(vpage_id + i);
+                    }
+                    if (pending_discards->size() >= MAX_DISCARD_BATCH)
+                        discard_func(context);
+                    resp.pointer = reinterpret_cast<void *>(num_kept + 1);
+                    break;
+                }
+                case request_type::Type::MigrateOut:
+                {
+                    // The buffer of the group comes in the response slot
+                    auto buffer = (char *)req.resp->pointer;
+                    auto begin = vpage_id / HOT_GROUP_PAGES * HOT_GROUP_PAGES;
+                    auto num = router.group_size(router.group_of(req.page_id));
+                    auto success = single_thread_cache->take(
+                        begin, num,
+                        [&](size_t i, ppage_id_type ppage_id)
+                        {
+                            std::memcpy(buffer + i * CACHE_PAGE_SIZE, phy_memory_pool->from_page_id(ppage_id),
+                                        CACHE_PAGE_SIZE);
+                        });
+                    if (success)
+                    {
+                        // The blocks left behind are never read again before the group is moved in anew
+                        for (size_t i = 0; i < num; i++)
+                        {
+                            zero_blocks->set(begin + i);
+                            pending_discards->push_back(begin + i);
+                        }
+                        if (pending_discards->size() >= MAX_DISCARD_BATCH)
+                            discard_func(context);
+                    }
+                    resp.pointer = success ? (void *)1 : reinterpret_cast<void *>(EMPTY_POINTER);
+                    break;
+                }
+                case request_type::Type::MigrateIn:
+                {
+                    // Only frames already free or held by clean pages are taken, so nothing is read or written
+                    // back here. A null buffer only makes the room, before the owner gives the group away.
+                    auto buffer = (const char *)req.resp->pointer;
+                    auto begin = vpage_id / HOT_GROUP_PAGES * HOT_GROUP_PAGES;
+                    auto num = router.group_size(router.group_of(req.page_id));
+                    // Frames held since the group was moved out make the room for putting it back
+                    single_thread_cache->release_held();
+                    bool success = single_thread_cache->reserve(num);
+                    for (size_t i = 0; i < num && success && buffer; i++)
+                    {
+                        // Skips reading the stale block
+                        zero_blocks->set(begin + i);
+                        auto ppage_id = single_thread_cache->pin_now(begin + i);
+                        assert(ppage_id != req_context_type::EMPTY_PPAGE_ID);
+                        std::memcpy(phy_memory_pool->from_page_id(ppage_id), buffer + i * CACHE_PAGE_SIZE,
+                                    CACHE_PAGE_SIZE);
+                        single_thread_cache->unpin(begin + i, true);
+                    }
+                    resp.pointer = success ? (void *)1 : reinterpret_cast<void *>(EMPTY_POINTER);
+                    break;
+                }
+                case request_type::Type::MigrateDone:
+                {
+                    single_thread_cache->release_held();
+                    resp.pointer = (void *)1;
+                    break;
+                }
+                case request_type::Type::SetCapacity:
                 case request_type::Type::None:
                 {
                     assert(false);
@@ -422,14 +1512,53 @@ namespace scache
                 return std::optional<req_context_type>{};
             };
 
-            auto processing_func = [&](auto &context, auto &req_context, const scache::request_type &req) FORCE_INLINE
+            auto processing_func =
+                [&, wake_pin_waiters](auto &context, auto &req_context, const scache::request_type &req) FORCE_INLINE
             {
-                auto &[phy_memory_pool, virt_io_backend, single_thread_cache] = context;
-                auto [sid, vpage_id] = partitioner(req.page_id);
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                auto vpage_id = req_context.vpage_id;
                 using req_context_type = typename std::decay_t<decltype(*single_thread_cache)>::context_type;
 
+                auto pre_phase = req_context.phase;
+                if constexpr (ENABLE_HOT_GROUP_MIGRATION)
+                {
+                    // The group moved away while the pin waited
+                    if (req.type == request_type::Type::Pin && pre_phase == req_context_type::Phase::Begin)
+                    {
+                        auto [route, sid, block_id] = router.resolve(req.page_id);
+                        if (sid != partition_id || block_id != vpage_id || (route & router_type::MOVING))
+                        {
+                            if (req.resp != nullptr)
+                                req.resp->pointer = reinterpret_cast<void *>(REDIRECT_POINTER);
+                            return true;
+                        }
+                    }
+                }
                 single_thread_cache->process(req_context);
 
+                if constexpr (ENABLE_PIN_WAITERS)
+                {
+                    if (req.type == request_type::Type::Pin)
+                    {
+                        if (req_context.phase == req_context_type::Phase::End)
+                        {
+                            if (req_context.ppage_id == req_context_type::EMPTY_PPAGE_ID && !req_context.failed &&
+                                req.resp != nullptr)
+                            {
+                                parked_pins->waiting.emplace_back(req, io_stats_now());
+                                return true;
+                            }
+                            wake_pin_waiters(context, vpage_id, req_context.failed);
+                        }
+                        else if (pre_phase == req_context_type::Phase::Begin &&
+                                 req_context.phase != req_context_type::Phase::Begin)
+                        {
+                            pin_waiters->try_emplace(vpage_id);
+                        }
+                    }
+                }
+
                 if (req_context.phase != req_context_type::Phase::End)
                     return false;
 
@@ -440,10 +1569,7 @@ namespace scache
                 {
                 case request_type::Type::Pin:
                 {
-                    if (req_context.ppage_id == req_context_type::EMPTY_PPAGE_ID)
-                        req.resp->pointer = reinterpret_cast<void *>(EMPTY_POINTER);
-                    else
-                        req.resp->pointer = phy_memory_pool->from_page_id(req_context.ppage_id);
+                    req.resp->pointer = pin_answer(phy_memory_pool, req_context);
                     break;
                 }
                 case request_type::Type::Unpin:
@@ -460,6 +1586,11 @@ namespace scache
                 }
                 case request_type::Type::NotifyDirectPin:
                 case request_type::Type::NotifyDirectUnpin:
+                case request_type::Type::Discard:
+                case request_type::Type::MigrateOut:
+                case request_type::Type::MigrateIn:
+                case request_type::Type::MigrateDone:
+                case request_type::Type::SetCapacity:
                 case request_type::Type::None:
                 {
                     assert(false);
@@ -469,15 +1600,202 @@ namespace scache
                 return true;
             };
 
-            auto destroy_context = [&](auto &context) FORCE_INLINE
+            auto destroy_context = [&, discard_func](auto &context) FORCE_INLINE
             {
-                auto &[phy_memory_pool, virt_io_backend, single_thread_cache] = context;
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
                 if (single_thread_cache->num_pinned())
                     printf("SharedCache destructs with pinned pages.\n");
+                for (auto &[req, parked_time] : parked_pins->waiting)
+                    req.resp->pointer = reinterpret_cast<void *>(EMPTY_POINTER);
+                parked_pins->waiting.clear();
+                discard_func(context);
                 // single_thread_cache->flush();
+                if (is_persistent())
+                {
+                    if (single_thread_cache->num_pinned())
+                        printf("Persistent SharedCache writes back pinned pages.\n");
+                    auto num_failed = single_thread_cache->flush();
+                    if (num_failed || !virt_io_backend->sync())
+                    {
+                        fprintf(stderr, "Persistent SharedCache lost %lu pages on write-back errors\n", num_failed);
+                        lost_writes = true;
+                    }
+                }
+                auto sid = std::find(phy_memory_pools, phy_memory_pools + num_partitions, phy_memory_pool.get()) -
+                           phy_memory_pools;
+                if (is_persistent())
+                    zero_blocks->store(zero_block_map_path(sid));
+                if constexpr (ENABLE_IOPS_STATS)
+                {
+                    auto &stats = single_thread_cache->get_stats();
+                    printf("Partition %lu evictions: %lu total, %lu waited on write-back, %lu pages cleaned, %lu pages "
+                           "discarded\n",
+                           sid, stats.num_evictions, stats.num_dirty_evictions, stats.num_cleaned,
+                           stats.num_discarded);
+                    printf("Partition %lu zero pages: %lu writes elided, %lu reads elided\n", sid,
+                           zero_blocks->num_elided_writes, zero_blocks->num_elided_reads);
+                }
+            };
+
+            auto idle_func = [&, discard_func](auto &context) FORCE_INLINE
+            {
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                if (!pending_discards->empty())
+                    discard_func(context);
+                if constexpr (ENABLE_BACKGROUND_CLEANER)
+                    return single_thread_cache->clean(CLEANER_LOW_WATERMARK, CLEANER_HIGH_WATERMARK,
+                                                      CLEANER_MAX_INFLIGHT);
+                return false;
+            };
+
+            auto resume_func = [&, wake_parked_pins](auto &context, auto &&push) FORCE_INLINE
+            {
+                auto &[phy_memory_pool, virt_io_backend, single_thread_cache, zero_blocks, pending_discards,
+                       pin_waiters, parked_pins, partition_id] = context;
+                if constexpr (ENABLE_PIN_WAITERS)
+                {
+                    // Woken after the unpins and notified unpins of the whole loop, as a direct pin of the same
+                    // page may be notified right after its unpin
+                    auto &waiting = parked_pins->waiting;
+                    if (!waiting.empty())
+                    {
+                        wake_parked_pins(context);
+                        // Most likely the client waiting holds the pinned pages itself
+                        auto now = io_stats_now();
+                        auto timeout = pin_timeout_ns.load(std::memory_order_relaxed);
+                        while (timeout && !waiting.empty() && now - waiting.front().second >= timeout)
+                        {
+                            waiting.front().first.resp->pointer = reinterpret_cast<void *>(EMPTY_POINTER);
+                            waiting.pop_front();
+                        }
+                    }
+                    for (auto &[req, req_context] : parked_pins->resumed)
+                        push(req, req_context);
+                    parked_pins->resumed.clear();
+                }
             };
 
-            server.run(create_context, pre_processing_func, first_processing_func, processing_func, destroy_context);
+            server.run(create_context, pre_processing_func, first_processing_func, processing_func, destroy_context,
+                       idle_func, resume_func);
+        }
+
+        // Pins that found every page pinned in arrival order, with the time they parked, and the ones woken by an
+        // unpin that wait for their load to be resumed by the server loop
+        template <typename ContextType> struct ParkedPins
+        {
+            std::deque<std::pair<request_type, uint64_t>> waiting;
+            std::vector<std::pair<request_type, ContextType>> resumed;
+        };
+
+        std::string zero_block_map_path(size_t sid) const { return persist_path + ".zero." + std::to_string(sid); }
+
+        std::string route_table_path() const { return persist_path + ".routes"; }
+
+        // Frames of a partition for num_ppages in total, with room to grow by balancing unless the backend locks them
+        static size_t partition_frames(size_t num_ppages, size_t num_partitions, bool registered = false)
+        {
+            auto share = num_ppages / num_partitions + (num_ppages % num_partitions != 0);
+            if (!ENABLE_MEMORY_BALANCING || num_partitions == 1 || (registered && !ENABLE_REGISTERED_MEMORY_BALANCING))
+                return share;
+            return std::max(share, std::min(num_ppages, share * MAX_PARTITION_GROWTH));
+        }
+
+        // Returns false if dirty victims are still being written back, the same capacity may be sent again
+        bool send_capacity(PartitionClient *client, size_t sid, ppage_id_type capacity)
+        {
+            cacheline_aligned_type<scache::response_type> resp;
+            client->request(sid, {request_type::Type::SetCapacity, capacity, &resp()}, &resp());
+            client->wait();
+            return reinterpret_cast<uintptr_t>(resp().pointer) != EMPTY_POINTER;
+        }
+
+        // Response to a pin that ended
+        template <typename ContextType>
+        static void *pin_answer(const std::shared_ptr<MemoryPool> &phy_memory_pool, const ContextType &ret)
+        {
+            if (ret.failed)
+                return reinterpret_cast<void *>(IO_ERROR_POINTER);
+            if (ret.ppage_id == ContextType::EMPTY_PPAGE_ID)
+                return reinterpret_cast<void *>(EMPTY_POINTER);
+            return phy_memory_pool->from_page_id(ret.ppage_id);
+        }
+
+        // Sends a migration request with the group buffer and waits for the result
+        bool migrate(PartitionClient *client, size_t sid, request_type::Type type, vpage_id_type vpage_id, void *buffer)
+        {
+            cacheline_aligned_type<scache::response_type> resp;
+            resp() = {buffer};
+            client->request(sid, {type, vpage_id, &resp()}, &resp());
+            client->wait();
+            return reinterpret_cast<uintptr_t>(resp().pointer) != EMPTY_POINTER;
+        }
+
+        // Whether the distinct pages of a batch fit in the capacities of their partitions
+        bool fits(const vpage_id_type *vpage_ids, size_t num)
+        {
+            size_t min_capacity = std::numeric_limits<size_t>::max();
+            for (size_t sid = 0; sid < num_partitions; sid++)
+                min_capacity = std::min<size_t>(min_capacity, *capacities[sid]);
+            if (num <= min_capacity)
+                return true;
+            std::vector<vpage_id_type> distinct(vpage_ids, vpage_ids + num);
+            std::sort(distinct.begin(), distinct.end());
+            distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+            std::vector<size_t> counts(num_partitions, 0);
+            for (auto vpage_id : distinct)
+            {
+                auto sid = std::get<0>(router(vpage_id));
+                if (++counts[sid] > *capacities[sid])
+                    return false;
+            }
+            return true;
+        }
+
+        // Whether to give up a pin answered without a page. With pin waiters the partition parks the pin until an
+        // unpin frees a frame, and only answers so after the pin timeout or at shutdown. Otherwise the pin is sent
+        // again until the timeout passed since the first such answer, recorded in empty_since.
+        bool give_up_empty(uint64_t &empty_since) const
+        {
+            if (ENABLE_PIN_WAITERS)
+                return true;
+            auto now = io_stats_now();
+            if (!empty_since)
+                empty_since = now;
+            auto timeout = pin_timeout_ns.load(std::memory_order_relaxed);
+            if (timeout && now - empty_since >= timeout)
+                return true;
+            nano_spin();
+            return false;
+        }
+
+        // Pins where the page is served now. Fails if the group is moving, or moved between the lookup and the pin.
+        FORCE_INLINE void *direct_pin(vpage_id_type vpage_id, PartitionClient *&client)
+        {
+            auto [route, sid, block_id] = router.resolve(vpage_id);
+            if (route & router_type::MOVING)
+                return nullptr;
+            auto [success, ppage_id, pre_ref_count] = page_tables[sid]->pin(block_id);
+            if (!success)
+                return nullptr;
+            if constexpr (ENABLE_HOT_GROUP_MIGRATION)
+            {
+                // A stale route may have hit the next group of the spare slot
+                if (std::get<0>(router.resolve(vpage_id)) != route)
+                {
+                    page_tables[sid]->unpin(block_id, false);
+                    return nullptr;
+                }
+            }
+            if (pre_ref_count == 0)
+            {
+                if (!client)
+                    client = get_client();
+                scache::request_type req = {request_type::Type::NotifyDirectPin, vpage_id};
+                client->request(sid, req);
+            }
+            return phy_memory_pools[sid]->from_page_id(ppage_id);
         }
 
         void check_addr(uintptr_t addr, size_t size) const
@@ -492,22 +1810,54 @@ namespace scache
 
         const size_t virt_size;
         const size_t phy_size;
+        const size_t max_phy_size;
         const size_t num_vpages;
         const size_t num_ppages;
         const size_t num_partitions;
         const size_t num_ppages_per_partition;
+        const size_t max_ppages_per_partition; // frames of each partition, its capacity varies below
         const size_t actual_num_ppages_per_thread;
         const std::vector<size_t> server_cpus;
         const std::vector<std::string> server_paths;
         const size_t max_num_clients;
-        RoundRobinPartitioner partitioner;
+        const IOBackendType io_backend;
+        const std::string persist_path;
+        const IOScheduleConfig io_schedule;
+        uint8_t *const frame_buffer; // frames of all partitions when given by the caller, e.g. shared memory
+        const bool persist_recover;  // starts after an unclean shutdown instead of refusing it
+        bool reattached;
+        bool recovered;
+        CachePartitioner partitioner;
+        using router_type = SkewAwarePartitioner<CachePartitioner>;
+        router_type router;
+        std::mutex rebalance_mutex;
+        std::vector<size_t> last_ghost_hits;
+        std::atomic<size_t> cur_num_ppages; // changed by resize_physical
+        // Even share of a partition at the physical size, private caches follow it. Lowered before a shrink, so that
+        // they release their pins first.
+        std::atomic<size_t> partition_share;
+        std::atomic<bool> lost_writes; // a page of a persistent cache could not be written back at shutdown
+        std::atomic<uint64_t> pin_timeout_ns;
         PartitionServer server;
         boost::thread_specific_ptr<std::shared_ptr<PartitionClient>> clients;
 
         MemoryPool *phy_memory_pools[MAX_THREADS];
         CompactHashPageTable *page_tables[MAX_THREADS];
+        const EvictionStats *eviction_stats[MAX_THREADS];
+        const ppage_id_type *capacities[MAX_THREADS];
+        const IOStats *io_stats[MAX_THREADS];
+        IOThrottle shared_throttle;
+        IOThrottle partition_throttles[MAX_THREADS];
 
         constexpr static uintptr_t EMPTY_POINTER = std::numeric_limits<uintptr_t>::max();
+        // Answer to a request sent to a partition that no longer serves the page
+        constexpr static uintptr_t REDIRECT_POINTER = std::numeric_limits<uintptr_t>::max() - 1;
+        // Answer to a pin whose page, or the victim making room for it, failed to be read or written back
+        constexpr static uintptr_t IO_ERROR_POINTER = std::numeric_limits<uintptr_t>::max() - 2;
+        // Recorded in the superblock, the vpage to block mapping depends on it
+        constexpr static uint64_t PARTITIONER_ID =
+            STRIPE_PAGES | (ENABLE_STRIPE_HASHING ? 1lu << 31 : 0) |
+            (ENABLE_HOT_GROUP_MIGRATION ? HOT_GROUP_PAGES << 32 | SPARE_GROUP_RATIO << 48 : 0);
 
         AccessCounter counter;
     };
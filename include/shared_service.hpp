@@ -0,0 +1,582 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "partition_type.hpp"
+#include "shared_cache.hpp"
+#include "type.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <signal.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace scache
+{
+    constexpr size_t SERVICE_MAX_CLIENTS = 64;
+    constexpr size_t SERVICE_RING_DEPTH = 32;
+    // Proxy loops between liveness checks of the client processes
+    constexpr size_t SERVICE_LIVENESS_LOOPS = 1lu << 12;
+    // Idle proxy loops before the proxy starts sleeping
+    constexpr size_t SERVICE_IDLE_LOOPS = 1lu << 14;
+    // Results of failed requests
+    constexpr uint64_t SERVICE_ERROR = std::numeric_limits<uint64_t>::max(); // invalid page, or unpin not pinned
+    constexpr uint64_t SERVICE_OOM_ERROR = SERVICE_ERROR - 1;               // every page of the partition pinned
+    constexpr uint64_t SERVICE_IO_ERROR = SERVICE_ERROR - 2;                // the page or its victim not transferred
+
+    // Start time of a process in clock ticks since boot, tells a reused pid apart. 0 if the process is gone.
+    inline uint64_t process_start_time(pid_t pid)
+    {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        if (!std::getline(stat, line))
+            return 0;
+        // The command name may hold spaces, fields are counted after it
+        auto pos = line.rfind(')');
+        if (pos == std::string::npos)
+            return 0;
+        std::istringstream fields(line.substr(pos + 1));
+        std::string field;
+        for (size_t i = 3; i <= 22; i++)
+            fields >> field;
+        return fields ? std::stoull(field) : 0;
+    }
+
+    // start_time 0 skips the check against pid reuse
+    inline bool process_alive(pid_t pid, uint64_t start_time)
+    {
+        if (kill(pid, 0) != 0 && errno == ESRCH)
+            return false;
+        return !start_time || process_start_time(pid) == start_time;
+    }
+
+    // One request of a client, owned by the client while Free or Done and by the daemon while Posted or Processing
+    struct service_request_type
+    {
+        enum class State : uint32_t
+        {
+            Free = 0,
+            Posted = 1,
+            Processing = 2,
+            Done = 3,
+        };
+        std::atomic<State> state;
+        request_type::Type type;
+        vpage_id_type vpage_id;
+        uint64_t result; // offset of the frame in the frame area for pins, SERVICE_*ERROR on failure
+    };
+
+    struct alignas(CACHELINE_SIZE) service_slot_type
+    {
+        std::atomic<uint64_t> owner_pid; // 0 when free
+        std::atomic<uint64_t> owner_start_time;
+        std::atomic<bool> closing;
+        service_request_type requests[SERVICE_RING_DEPTH];
+    };
+
+    // Head of the named shared-memory segment, followed by the frame area
+    struct service_header_type
+    {
+        constexpr static uint64_t MAGIC = 0x5643534548434153; // "SACHESCV"
+        constexpr static uint64_t VERSION = 1;
+
+        uint64_t magic;
+        uint64_t version;
+        uint64_t page_size;
+        uint64_t virt_size;
+        uint64_t frame_offset;
+        uint64_t segment_size;
+        uint64_t daemon_start_time;
+        std::atomic<uint64_t> daemon_pid; // written last, 0 while the daemon starts
+        service_slot_type slots[SERVICE_MAX_CLIENTS];
+    };
+
+    // Runs a SharedCache in a daemon for the client processes of one machine. The frames live in the named
+    // shared-memory segment (shm_open) next to one request ring per client, and proxy threads of the daemon serve the
+    // rings with pin_async(), so pins of several clients overlap. Pins are tracked per client and released when the
+    // client process exits or crashes, then its slot is reused.
+    class SharedCacheService
+    {
+    public:
+        SharedCacheService(std::string _name,
+                           size_t _virt_size,
+                           size_t _phy_size,
+                           std::vector<size_t> _server_cpus,
+                           std::vector<std::string> _server_paths,
+                           size_t _num_proxies,
+                           IOBackendType _io_backend = DEFAULT_IO_BACKEND,
+                           std::string _persist_path = "",
+                           size_t _max_phy_size = 0,
+                           IOScheduleConfig _io_schedule = IOScheduleConfig(),
+                           bool _persist_recover = false)
+            : name(_name),
+              num_proxies(_num_proxies),
+              segment(name, _virt_size, SharedCache::frame_buffer_size(_phy_size, _max_phy_size, _server_cpus.size())),
+              header(segment.header),
+              cache(_virt_size, _phy_size, _server_cpus, _server_paths, num_proxies + 1, _io_backend, _persist_path,
+                    _max_phy_size, _io_schedule, (uint8_t *)header + header->frame_offset, _persist_recover),
+              is_stop(false)
+        {
+            if (!num_proxies || num_proxies > SERVICE_MAX_CLIENTS)
+                throw std::runtime_error("Parameter Error");
+            header->daemon_start_time = process_start_time(getpid());
+            header->daemon_pid.store(getpid(), std::memory_order_release);
+            for (size_t i = 0; i < num_proxies; i++)
+                proxies.emplace_back([this, i]() { proxy(i); });
+        }
+
+        SharedCacheService(const SharedCacheService &) = delete;
+        SharedCacheService(SharedCacheService &&) = delete;
+
+        // Clients still attached fail on their next request
+        ~SharedCacheService()
+        {
+            is_stop = true;
+            for (auto &proxy : proxies)
+                proxy.join();
+            header->daemon_pid.store(0, std::memory_order_release);
+        }
+
+        // For resizing and statistics in the daemon
+        SharedCache &get_cache() { return cache; }
+
+    private:
+        // Outlives the cache, whose servers flush the frames when stopping
+        struct segment_type
+        {
+            segment_type(const std::string &_name, size_t virt_size, size_t frame_size)
+                : name(_name), header(create_segment(name, virt_size, frame_size))
+            {
+            }
+            ~segment_type()
+            {
+                shm_unlink(name.c_str());
+                munmap(header, header->segment_size);
+            }
+            const std::string name;
+            service_header_type *const header;
+        };
+
+        static service_header_type *create_segment(const std::string &name, size_t virt_size, size_t frame_size)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd < 0 && errno == EEXIST)
+            {
+                // Left behind by a crashed daemon
+                if (auto pid = daemon_of(name))
+                    throw std::runtime_error("Cache service " + name + " is running in " + std::to_string(pid));
+                shm_unlink(name.c_str());
+                fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            }
+            if (fd < 0)
+                throw std::runtime_error("Create Shared Memory Error");
+
+            auto frame_offset = (sizeof(service_header_type) + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+            auto segment_size = frame_offset + frame_size;
+            if (ftruncate(fd, segment_size) != 0)
+            {
+                close(fd);
+                shm_unlink(name.c_str());
+                throw std::runtime_error("Resize Shared Memory Error");
+            }
+            auto header =
+                (service_header_type *)mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (header == MAP_FAILED)
+            {
+                shm_unlink(name.c_str());
+                throw std::runtime_error("mmap Shared Memory Error");
+            }
+
+            // The segment starts zeroed, so all slots are free
+            header->magic = service_header_type::MAGIC;
+            header->version = service_header_type::VERSION;
+            header->page_size = CACHE_PAGE_SIZE;
+            header->virt_size = virt_size;
+            header->frame_offset = frame_offset;
+            header->segment_size = segment_size;
+            return header;
+        }
+
+        // pid of the live daemon serving the segment, 0 if none
+        static pid_t daemon_of(const std::string &name)
+        {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+                return 0;
+            struct stat st;
+            pid_t pid = 0;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(service_header_type))
+            {
+                auto header = (service_header_type *)mmap(nullptr, sizeof(service_header_type), PROT_READ,
+                                                          MAP_SHARED, fd, 0);
+                if (header != MAP_FAILED)
+                {
+                    pid = header->daemon_pid.load();
+                    if (pid && !process_alive(pid, header->daemon_start_time))
+                        pid = 0;
+                    munmap(header, sizeof(service_header_type));
+                }
+            }
+            close(fd);
+            return pid;
+        }
+
+        struct in_flight_type
+        {
+            in_flight_type(SharedCache &cache, size_t _sid, size_t _rid, vpage_id_type _vpage_id,
+                           PartitionClient *client)
+                : sid(_sid), rid(_rid), vpage_id(_vpage_id), orphan(false), handle(cache.pin_async(_vpage_id, client))
+            {
+            }
+            size_t sid, rid;
+            vpage_id_type vpage_id; // the request in shared memory may be rewritten by the client
+            bool orphan; // the client is gone, the page is released on completion
+            SharedCache::PinHandle handle;
+        };
+
+        // Serves the slots sid % num_proxies == proxy_id
+        void proxy(size_t proxy_id)
+        {
+            auto client = cache.get_client();
+            auto frames = (uint8_t *)header + header->frame_offset;
+            std::list<in_flight_type> in_flights;
+            // Pin counts of the pages held by each client
+            std::vector<std::unordered_map<vpage_id_type, size_t>> pins(SERVICE_MAX_CLIENTS);
+            size_t loops = 0, idle_loops = 0, spin_loops = 0;
+
+            auto reclaim = [&](size_t sid)
+            {
+                auto &slot = header->slots[sid];
+                for (auto [vpage_id, count] : pins[sid])
+                {
+                    // The client may have written
+                    for (size_t i = 0; i < count; i++)
+                        cache.unpin(vpage_id, true, client);
+                }
+                pins[sid].clear();
+                for (auto &in_flight : in_flights)
+                {
+                    if (in_flight.sid == sid)
+                        in_flight.orphan = true;
+                }
+                for (auto &req : slot.requests)
+                    req.state.store(service_request_type::State::Free, std::memory_order_relaxed);
+                slot.closing.store(false, std::memory_order_relaxed);
+                slot.owner_start_time.store(0, std::memory_order_relaxed);
+                slot.owner_pid.store(0, std::memory_order_release);
+            };
+
+            while (!is_stop.load(std::memory_order_relaxed))
+            {
+                bool busy = false;
+                bool check_liveness = ++loops % SERVICE_LIVENESS_LOOPS == 0;
+                for (size_t sid = proxy_id; sid < SERVICE_MAX_CLIENTS; sid += num_proxies)
+                {
+                    auto &slot = header->slots[sid];
+                    auto pid = slot.owner_pid.load(std::memory_order_acquire);
+                    if (!pid)
+                        continue;
+                    if (slot.closing.load(std::memory_order_acquire) ||
+                        (check_liveness && !process_alive(pid, slot.owner_start_time.load())))
+                    {
+                        reclaim(sid);
+                        busy = true;
+                        continue;
+                    }
+
+                    for (size_t rid = 0; rid < SERVICE_RING_DEPTH; rid++)
+                    {
+                        auto &req = slot.requests[rid];
+                        if (req.state.load(std::memory_order_acquire) != service_request_type::State::Posted)
+                            continue;
+                        busy = true;
+                        // Read once, the client may rewrite them
+                        auto type = req.type;
+                        auto vpage_id = req.vpage_id;
+                        if (vpage_id >= header->virt_size / CACHE_PAGE_SIZE)
+                        {
+                            req.result = SERVICE_ERROR;
+                        }
+                        else if (type == request_type::Type::Pin)
+                        {
+                            req.state.store(service_request_type::State::Processing, std::memory_order_relaxed);
+                            in_flights.emplace_back(cache, sid, rid, vpage_id, client);
+                            continue;
+                        }
+                        else if (type != request_type::Type::Unpin && type != request_type::Type::DirtyUnpin)
+                        {
+                            req.result = SERVICE_ERROR;
+                        }
+                        else
+                        {
+                            auto iter = pins[sid].find(vpage_id);
+                            if (iter == pins[sid].end())
+                            {
+                                req.result = SERVICE_ERROR;
+                            }
+                            else
+                            {
+                                cache.unpin(vpage_id, type == request_type::Type::DirtyUnpin, client);
+                                if (--iter->second == 0)
+                                    pins[sid].erase(iter);
+                                req.result = 0;
+                            }
+                        }
+                        req.state.store(service_request_type::State::Done, std::memory_order_release);
+                    }
+                }
+
+                for (auto iter = in_flights.begin(); iter != in_flights.end();)
+                {
+                    auto &req = header->slots[iter->sid].requests[iter->rid];
+                    try
+                    {
+                        if (!iter->handle.ready())
+                        {
+                            iter++;
+                            continue;
+                        }
+                    }
+                    catch (const std::runtime_error &e)
+                    {
+                        // A failed handle holds no pin
+                        busy = true;
+                        if (!iter->orphan)
+                        {
+                            req.result = std::strcmp(e.what(), SharedCache::PIN_IO_ERROR) == 0 ? SERVICE_IO_ERROR
+                                                                                                : SERVICE_OOM_ERROR;
+                            req.state.store(service_request_type::State::Done, std::memory_order_release);
+                        }
+                        iter = in_flights.erase(iter);
+                        continue;
+                    }
+                    busy = true;
+                    auto pointer = (uint8_t *)iter->handle.release();
+                    if (iter->orphan)
+                    {
+                        cache.unpin(iter->vpage_id, false, client);
+                    }
+                    else
+                    {
+                        pins[iter->sid][iter->vpage_id]++;
+                        req.result = pointer - frames;
+                        req.state.store(service_request_type::State::Done, std::memory_order_release);
+                    }
+                    iter = in_flights.erase(iter);
+                }
+
+                if (busy)
+                    idle_loops = 0;
+                else if (++idle_loops < SERVICE_IDLE_LOOPS)
+                    hybrid_spin(spin_loops);
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+
+            // Leaves no page pinned for the cache to flush
+            for (auto &in_flight : in_flights)
+            {
+                try
+                {
+                    in_flight.handle.release();
+                }
+                catch (const std::runtime_error &)
+                {
+                    continue;
+                }
+                cache.unpin(in_flight.vpage_id, false, client);
+            }
+            for (size_t sid = proxy_id; sid < SERVICE_MAX_CLIENTS; sid += num_proxies)
+            {
+                for (auto [vpage_id, count] : pins[sid])
+                {
+                    for (size_t i = 0; i < count; i++)
+                        cache.unpin(vpage_id, true, client);
+                }
+            }
+            cache.del_client();
+        }
+
+        const std::string name;
+        const size_t num_proxies;
+        segment_type segment;
+        service_header_type *const header;
+        SharedCache cache;
+        std::atomic_bool is_stop;
+        std::vector<std::thread> proxies;
+    };
+
+    // Attaches to the SharedCacheService with the given name, from any process of the machine. Takes one client slot
+    // of the service, so every thread needs its own. Pins return pointers into the shared frames; unpins are not
+    // awaited, an unpin of a page not pinned through this client fails at a later request.
+    class SharedCacheServiceClient
+    {
+    public:
+        SharedCacheServiceClient(const std::string &name) : header(attach(name)), slot(nullptr), cell_is_unpin{}
+        {
+            frames = (uint8_t *)header + header->frame_offset;
+            daemon_pid = header->daemon_pid.load(std::memory_order_acquire);
+            daemon_start_time = header->daemon_start_time;
+
+            uint64_t pid = getpid();
+            for (auto &candidate : header->slots)
+            {
+                uint64_t expected = 0;
+                if (candidate.owner_pid.compare_exchange_strong(expected, pid))
+                {
+                    slot = &candidate;
+                    break;
+                }
+            }
+            if (!slot)
+            {
+                munmap(header, header->segment_size);
+                throw std::runtime_error("Cache service cannot support more clients");
+            }
+            // Until this is set, the daemon only checks that the pid is alive
+            slot->owner_start_time.store(process_start_time(pid));
+        }
+
+        SharedCacheServiceClient(const SharedCacheServiceClient &) = delete;
+        SharedCacheServiceClient(SharedCacheServiceClient &&) = delete;
+
+        // The daemon releases the pages still pinned
+        ~SharedCacheServiceClient()
+        {
+            slot->closing.store(true, std::memory_order_release);
+            munmap(header, header->segment_size);
+        }
+
+        void *pin(vpage_id_type vpage_id)
+        {
+            auto &req = post(request_type::Type::Pin, vpage_id);
+            wait(req);
+            auto result = req.result;
+            req.state.store(service_request_type::State::Free, std::memory_order_relaxed);
+            if (result == SERVICE_ERROR)
+                throw std::runtime_error("Virtual Page ID Error");
+            if (result == SERVICE_OOM_ERROR)
+                throw std::runtime_error(SharedCache::PIN_OOM_ERROR);
+            if (result == SERVICE_IO_ERROR)
+                throw std::runtime_error(SharedCache::PIN_IO_ERROR);
+            return frames + result;
+        }
+
+        void unpin(vpage_id_type vpage_id, bool is_write = false)
+        {
+            post(is_write ? request_type::Type::DirtyUnpin : request_type::Type::Unpin, vpage_id);
+        }
+
+        size_t get_virt_size() const { return header->virt_size; }
+
+    private:
+        static service_header_type *attach(const std::string &name)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR, 0);
+            if (fd < 0)
+                throw std::runtime_error("Cache service " + name + " not found");
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(service_header_type))
+            {
+                close(fd);
+                throw std::runtime_error("Invalid cache service " + name);
+            }
+            auto header = (service_header_type *)mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (header == MAP_FAILED)
+                throw std::runtime_error("mmap Shared Memory Error");
+
+            auto pid = header->daemon_pid.load(std::memory_order_acquire);
+            if (header->magic != service_header_type::MAGIC || header->version != service_header_type::VERSION ||
+                header->page_size != CACHE_PAGE_SIZE || header->segment_size != (size_t)st.st_size || !pid ||
+                !process_alive(pid, header->daemon_start_time))
+            {
+                munmap(header, st.st_size);
+                throw std::runtime_error("Invalid cache service " + name);
+            }
+            return header;
+        }
+
+        // Takes a free cell, recycling the ones of served unpins
+        service_request_type &post(request_type::Type type, vpage_id_type vpage_id)
+        {
+            size_t loops = 0;
+            while (true)
+            {
+                for (size_t rid = 0; rid < SERVICE_RING_DEPTH; rid++)
+                {
+                    auto &req = slot->requests[rid];
+                    auto state = req.state.load(std::memory_order_acquire);
+                    if (state == service_request_type::State::Done && cell_is_unpin[rid])
+                    {
+                        if (req.result == SERVICE_ERROR)
+                        {
+                            req.state.store(service_request_type::State::Free, std::memory_order_relaxed);
+                            throw std::runtime_error("Unpin of a page not pinned");
+                        }
+                    }
+                    else if (state != service_request_type::State::Free)
+                    {
+                        continue;
+                    }
+                    req.type = type;
+                    req.vpage_id = vpage_id;
+                    cell_is_unpin[rid] = type != request_type::Type::Pin;
+                    req.state.store(service_request_type::State::Posted, std::memory_order_release);
+                    return req;
+                }
+                check_daemon(loops);
+            }
+        }
+
+        void wait(service_request_type &req)
+        {
+            size_t loops = 0;
+            while (req.state.load(std::memory_order_acquire) != service_request_type::State::Done)
+                check_daemon(loops);
+        }
+
+        void check_daemon(size_t &loops)
+        {
+            if (++spins % SERVICE_LIVENESS_LOOPS == 0 &&
+                (header->daemon_pid.load(std::memory_order_relaxed) != (uint64_t)daemon_pid ||
+                 !process_alive(daemon_pid, daemon_start_time)))
+                throw std::runtime_error("Cache service is gone");
+            hybrid_spin(loops);
+        }
+
+        service_header_type *const header;
+        service_slot_type *slot;
+        uint8_t *frames;
+        pid_t daemon_pid;
+        uint64_t daemon_start_time;
+        bool cell_is_unpin[SERVICE_RING_DEPTH];
+        size_t spins = 0;
+    };
+} // namespace scache
@@ -16,12 +16,14 @@
 #include "compact_hash_page_table.hpp"
 #include "type.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <atomic>
 #include <boost/fiber/all.hpp>
 #include <cstdint>
 #include <functional>
 #include <immintrin.h>
 #include <limits>
+#include <list>
 #include <optional>
 #include <stdexcept>
 #include <tuple>
@@ -29,6 +31,19 @@
 
 namespace scache
 {
+    struct EvictionStats
+    {
+        size_t num_evictions = 0;
+        size_t num_dirty_evictions = 0; // demand misses waiting on a write-back
+        size_t num_cleaned = 0;         // pages written back by the background cleaner
+        size_t num_discarded = 0;       // freed pages dropped without write-back
+        size_t num_misses = 0;
+        size_t num_ghost_hits = 0; // misses on recently evicted pages, which more pages would have hit
+    };
+
+    // evict_func and load_func return true once done, and set failed in the external context if their I/O failed.
+    // A pin whose victim cannot be written back or whose page cannot be loaded ends failed without a page, the victim
+    // stays dirty and resident. Pages the cleaner cannot write back stay dirty.
     template <typename ReplacementType,
               typename ExternalContextType,
               typename ExternalStateType,
@@ -73,6 +88,7 @@ namespace scache
                 End
             } phase;
             bool processing;
+            bool failed; // the pin ended without a page on an I/O error
             bool dirty;
             bool is_write;
             bool is_unpin;
@@ -89,6 +105,14 @@ namespace scache
             constexpr static ppage_id_type EMPTY_PPAGE_ID = std::numeric_limits<ppage_id_type>::max();
         };
 
+        struct cleaning_context_type
+        {
+            vpage_id_type vpage_id;
+            ppage_id_type ppage_id;
+            CompactHashPageTable::packed_cache_line *hint;
+            external_context_type external_context;
+        };
+
         SharedSingleThreadCache(const vpage_id_type &_max_vpage_id,
                                 const ppage_id_type &_max_ppage_id,
                                 EvictFuncType _evict_func,
@@ -96,6 +120,7 @@ namespace scache
                                 external_context_type _default_external_context = external_context_type())
             : max_vpage_id(_max_vpage_id),
               max_ppage_id(_max_ppage_id),
+              capacity(max_ppage_id),
               page_table(max_vpage_id, max_ppage_id),
               pinned_size(0),
               cur_id(0),
@@ -103,7 +128,12 @@ namespace scache
               replacement(max_ppage_id),
               evict_func(_evict_func),
               load_func(_load_func),
-              default_external_context(_default_external_context)
+              default_external_context(_default_external_context),
+              stats(),
+              cleaning_contextes(),
+              last_clean_evictions(0),
+              wanted_room(0),
+              ghosts(std::max<size_t>(max_ppage_id, 1), internal_state_type::EMPTY_VPAGE_ID)
         {
             states = (state_type *)mmap_alloc(max_ppage_id * sizeof(state_type), CACHELINE_SIZE);
             for (size_t i = 0; i < max_ppage_id; i++)
@@ -121,18 +151,95 @@ namespace scache
 
         bool empty() const { return cur_id + recycle_pool.size() == max_ppage_id; }
 
-        bool full() const { return cur_id >= max_ppage_id && recycle_pool.empty(); }
+        bool full() const { return size() >= capacity; }
+
+        bool full_pin() const { return pinned_size >= (int64_t)capacity; }
+
+        ppage_id_type get_capacity() const { return capacity; }
+
+        // Evicts clean pages down to new_capacity (at most max_ppage_id), nothing is written back on the calling
+        // thread. Dirty victims are written back by up to max_inflight cleaning contexts and evicted by a later call
+        // once clean. release_func(ppage_id) is called for every frame freed. Pages that stay pinned or dirty keep the
+        // capacity above new_capacity, the capacity reached is returned.
+        template <typename ReleaseFuncType>
+        ppage_id_type set_capacity(ppage_id_type new_capacity, ReleaseFuncType &&release_func, size_t max_inflight)
+        {
+            capacity = std::min(new_capacity, max_ppage_id);
+            progress_cleaning();
+            evict_clean(capacity, release_func);
+            if (size() > capacity)
+            {
+                size_t num_cleaned = 0;
+                replacement.scan(size() - capacity,
+                                 [&](ppage_id_type ppage_id)
+                                 {
+                                     if (cleaning_contextes.size() >= max_inflight)
+                                         return false;
+                                     auto vpage_id = states[ppage_id].internal.vpage_id;
+                                     auto hint = page_table.find_hint(vpage_id);
+                                     if (hint == nullptr)
+                                         return true;
+                                     auto pte = page_table.get_pte(vpage_id, hint);
+                                     if (pte.exist && pte.dirty && !pte.busy && !pte.ref_count)
+                                         num_cleaned += start_cleaning(vpage_id, ppage_id, hint);
+                                     return true;
+                                 });
+                // Written back at once, e.g. zero pages
+                if (num_cleaned)
+                    evict_clean(capacity, release_func);
+            }
+            capacity = std::max(capacity, size());
+            return capacity;
+        }
+
+        // Evicts down to new_capacity (at most max_ppage_id) on the calling thread, for an evict_func that completes
+        // at once and cannot fail like the one of private caches. Pinned pages keep the capacity above new_capacity,
+        // the capacity reached is returned.
+        ppage_id_type set_capacity_now(ppage_id_type new_capacity)
+        {
+            capacity = std::min(new_capacity, max_ppage_id);
+            while (size() > capacity && replacement.size() > 0)
+            {
+                auto ppage_id = replacement.pop().first;
+                auto vpage_id = states[ppage_id].internal.vpage_id;
+                auto hint = page_table.find_hint(vpage_id);
+                assert(hint != nullptr);
+                auto pte = page_table.get_pte(vpage_id, hint);
+                if (pte.ref_count != 0 || pte.busy || !page_table.delete_mapping(vpage_id, hint))
+                    continue;
 
-        bool full_pin() const { return pinned_size >= (int64_t)max_ppage_id; }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                auto external_context = default_external_context;
+                while (!evict_func(external_context, vpage_id, ppage_id, pte.dirty, states[ppage_id].external))
+                    ;
+                stats.num_evictions++;
+                record_ghost(vpage_id);
+
+                init_state(ppage_id);
+                free(ppage_id);
+                page_table.release_mapping_lock(vpage_id, hint);
+            }
+            capacity = std::max(capacity, size());
+            return capacity;
+        }
+
+        // Whether write-backs of the cleaner are in flight
+        bool cleaning() const { return !cleaning_contextes.empty(); }
 
         int64_t num_pinned() const { return pinned_size; }
 
+        const EvictionStats &get_stats() const { return stats; }
+
+        bool contains(const vpage_id_type &vpage_id) const { return page_table.get_pte(vpage_id).exist; }
+
         context_type pin(const vpage_id_type &vpage_id)
         {
             context_type context;
             context.type = context_type::Type::Pin;
             context.phase = context_type::Phase::Begin;
             context.vpage_id = vpage_id;
+            context.ppage_id = context_type::EMPTY_PPAGE_ID;
+            context.failed = false;
             process(context);
             return context;
         }
@@ -243,6 +350,7 @@ namespace scache
                             }
 
                             pinned_size++;
+                            check_ghost(context.vpage_id);
 
                             if (full())
                             {
@@ -267,6 +375,9 @@ namespace scache
 
                                     context.pre_external_state = state.external;
                                     context.dirty = pre_pte.dirty;
+                                    stats.num_evictions++;
+                                    record_ghost(context.pre_vpage_id);
+                                    stats.num_dirty_evictions += context.dirty;
                                     break;
                                 }
 
@@ -322,6 +433,17 @@ namespace scache
 
                     if (context.pre_external_state.has_value())
                     {
+                        if (context.external_context.failed)
+                        {
+                            // The frame still holds the victim, which is mapped again
+                            page_table.restore_mapping(context.pre_vpage_id, context.ppage_id, context.pre_hint);
+                            page_table.release_mapping_lock(context.pre_vpage_id, context.pre_hint);
+                            replacement.push(context.ppage_id);
+                            stats.num_evictions--;
+                            stats.num_dirty_evictions -= context.dirty;
+                            fail(context);
+                            return;
+                        }
                         page_table.release_mapping_lock(context.pre_vpage_id, context.pre_hint);
                     }
 
@@ -358,6 +480,15 @@ namespace scache
                         std::atomic_thread_fence(std::memory_order_release);
                     }
 
+                    if (context.external_context.failed)
+                    {
+                        // The frame holds no valid data
+                        init_state(context.ppage_id);
+                        free(context.ppage_id);
+                        fail(context);
+                        return;
+                    }
+
                     page_table.release_mapping_lock(context.vpage_id, context.hint);
 
                     context.phase = context_type::Phase::End;
@@ -380,8 +511,154 @@ namespace scache
 
         void prefetch(const vpage_id_type &vpage_id) const { page_table.prefetch(vpage_id); }
 
-        void flush()
+        // Drops the page of a freed vpage without write-back.
+        // Returns false if it is pinned or busy, then the page is kept as it is.
+        bool discard(const vpage_id_type &vpage_id)
+        {
+            auto hint = page_table.find_hint(vpage_id);
+            if (hint == nullptr)
+                return true;
+            auto pte = page_table.get_pte(vpage_id, hint);
+            if (!pte.exist)
+                return true;
+            if (pte.busy || pte.ref_count || !page_table.delete_mapping(vpage_id, hint))
+                return false;
+
+            replacement.erase(pte.ppage_id);
+            init_state(pte.ppage_id);
+            free(pte.ppage_id);
+            page_table.release_mapping_lock(vpage_id, hint);
+            stats.num_discarded++;
+            return true;
+        }
+
+        // Pins on the calling thread, driving the load and eviction to the end.
+        // Returns EMPTY_PPAGE_ID without a pin if the page is busy or every page is pinned.
+        ppage_id_type pin_now(const vpage_id_type &vpage_id)
+        {
+            auto context = pin(vpage_id);
+            if (context.phase == context_type::Phase::Begin)
+                return context_type::EMPTY_PPAGE_ID;
+            while (context.phase != context_type::Phase::End)
+                process(context);
+            return context.ppage_id;
+        }
+
+        // Moves the pages of [begin, begin + num) out of the cache, copy_func(i, ppage_id) is called for each before
+        // its frame is held. Fails without a change if a page is absent, pinned or busy, so nothing is read here.
+        // Held frames count as used until release_held(), so the pages always fit back in.
+        template <typename CopyFuncType> bool take(vpage_id_type begin, size_t num, CopyFuncType &&copy_func)
+        {
+            size_t num_locked = 0;
+            for (; num_locked < num; num_locked++)
+            {
+                auto hint = page_table.find_hint(begin + num_locked);
+                if (hint == nullptr || !page_table.lock_mapping(begin + num_locked, hint))
+                    break;
+            }
+            if (num_locked < num)
+            {
+                for (size_t i = 0; i < num_locked; i++)
+                    page_table.release_mapping_lock(begin + i);
+                return false;
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            for (size_t i = 0; i < num; i++)
+            {
+                auto hint = page_table.find_hint(begin + i);
+                auto ppage_id = page_table.get_pte(begin + i, hint).ppage_id;
+                copy_func(i, ppage_id);
+                page_table.delete_locked_mapping(begin + i, hint);
+                replacement.erase(ppage_id);
+                init_state(ppage_id);
+                held.push_back(ppage_id);
+                page_table.release_mapping_lock(begin + i, hint);
+            }
+            return true;
+        }
+
+        void release_held()
+        {
+            for (auto ppage_id : held)
+                free(ppage_id);
+            held.clear();
+        }
+
+        // Makes num frames free below the capacity by evicting clean pages, dirty ones are left to the cleaner so
+        // that nothing is written back here. Returns whether num frames are free, a retry may succeed once the
+        // cleaner caught up.
+        bool reserve(size_t num)
+        {
+            if (num > capacity)
+                return false;
+            evict_clean(capacity - num, [](ppage_id_type) {});
+            auto success = size() + num <= capacity;
+            wanted_room = success ? 0 : num;
+            return success;
+        }
+
+        // Writes back dirty pages near the replacement hand, so that demand misses find clean victims.
+        // Starts when fewer than low_watermark clean candidates are ahead, stops at high_watermark.
+        // Returns whether write-backs are still in flight.
+        bool clean(size_t low_watermark, size_t high_watermark, size_t max_inflight)
+        {
+            progress_cleaning();
+
+            if (size() + wanted_room < capacity || (stats.num_evictions == last_clean_evictions && !wanted_room) ||
+                cleaning_contextes.size() >= max_inflight)
+                return !cleaning_contextes.empty();
+            last_clean_evictions = stats.num_evictions;
+            wanted_room = 0;
+
+            size_t num_clean = 0;
+            std::vector<std::tuple<vpage_id_type, ppage_id_type, CompactHashPageTable::packed_cache_line *>> dirties;
+            replacement.scan(high_watermark,
+                             [&](ppage_id_type ppage_id)
+                             {
+                                 auto vpage_id = states[ppage_id].internal.vpage_id;
+                                 auto hint = page_table.find_hint(vpage_id);
+                                 if (hint == nullptr)
+                                     return true;
+                                 auto pte = page_table.get_pte(vpage_id, hint);
+                                 if (!pte.exist || pte.busy || pte.ref_count)
+                                     return true;
+                                 if (pte.dirty)
+                                     dirties.emplace_back(vpage_id, ppage_id, hint);
+                                 else
+                                     num_clean++;
+                                 return true;
+                             });
+
+            if (num_clean + cleaning_contextes.size() >= low_watermark)
+                return !cleaning_contextes.empty();
+
+            // Issue the burst nearest to the hand in block order, so that backends merge contiguous blocks
+            auto num_burst = std::min(high_watermark - num_clean - cleaning_contextes.size(),
+                                      max_inflight - cleaning_contextes.size());
+            if (dirties.size() > num_burst)
+                dirties.resize(num_burst);
+            std::sort(dirties.begin(), dirties.end());
+
+            for (auto &[vpage_id, ppage_id, hint] : dirties)
+            {
+                if (num_clean + cleaning_contextes.size() >= high_watermark ||
+                    cleaning_contextes.size() >= max_inflight)
+                    break;
+                if (start_cleaning(vpage_id, ppage_id, hint))
+                    num_clean++;
+            }
+
+            return !cleaning_contextes.empty();
+        }
+
+        // Writes back and drops every page. Returns the number of pages that could not be written back, they stay
+        // dirty and resident.
+        size_t flush()
         {
+            while (clean(0, 0, 0))
+                ;
+
             std::vector<context_type> contextes(max_ppage_id);
             size_t size = 0;
             for (size_t i = 0; i < max_ppage_id; i++)
@@ -404,10 +681,6 @@ namespace scache
                     context.dirty = pre_pte.dirty;
                 }
 
-                context.external_context = default_external_context;
-
-                context.processing = !evict_func(context.external_context, context.pre_vpage_id, context.ppage_id,
-                                                 context.dirty, state.external);
                 size++;
             }
 
@@ -416,37 +689,152 @@ namespace scache
                 replacement.pop();
             }
 
-            size_t start, min_processing = 0;
-            do
+            // Write back in vpage (block) order with bounded depth, so that backends merge contiguous blocks
+            std::sort(contextes.begin(), contextes.begin() + size,
+                      [](const context_type &a, const context_type &b) { return a.pre_vpage_id < b.pre_vpage_id; });
+
+            size_t begin = 0, end = 0;
+            while (begin < size)
             {
-                start = min_processing;
-                min_processing = max_ppage_id;
-                for (size_t i = start; i < size; i++)
+                for (; end < size && end - begin < MAX_FLUSH_DEPTH; end++)
+                {
+                    auto &context = contextes[end];
+                    context.external_context = default_external_context;
+                    context.processing = !evict_func(context.external_context, context.pre_vpage_id,
+                                                     context.ppage_id, context.dirty,
+                                                     states[context.ppage_id].external);
+                }
+
+                for (size_t i = begin; i < end; i++)
                 {
                     auto &context = contextes[i];
                     if (context.processing)
                     {
-                        auto &state = states[context.ppage_id];
-
                         context.processing = !evict_func(context.external_context, context.pre_vpage_id,
-                                                         context.ppage_id, context.dirty, state.external);
-                        min_processing = i;
+                                                         context.ppage_id, context.dirty,
+                                                         states[context.ppage_id].external);
                     }
                 }
 
-            } while (min_processing != max_ppage_id);
+                while (begin < end && !contextes[begin].processing)
+                    begin++;
+            }
 
+            size_t num_failed = 0;
             for (size_t i = 0; i < size; i++)
             {
                 auto &context = contextes[i];
+                if (context.external_context.failed)
+                {
+                    num_failed++;
+                    replacement.push(context.ppage_id);
+                    continue;
+                }
                 page_table.delete_mapping(context.pre_vpage_id);
                 init_state(context.ppage_id);
                 free(context.ppage_id);
                 page_table.release_mapping_lock(context.pre_vpage_id);
             }
+            return num_failed;
         }
 
     private:
+        constexpr static size_t MAX_FLUSH_DEPTH = 1024;
+
+        // Drops the mapping created by a pin, whose frame was given back or freed already
+        void fail(context_type &context)
+        {
+            page_table.abort_mapping(context.vpage_id, context.hint);
+            page_table.release_mapping_lock(context.vpage_id, context.hint);
+            pinned_size--;
+            context.failed = true;
+            context.ppage_id = context_type::EMPTY_PPAGE_ID;
+            context.phase = context_type::Phase::End;
+        }
+
+        // Completes the write-backs of the cleaner that finished
+        void progress_cleaning()
+        {
+            for (auto it = cleaning_contextes.begin(); it != cleaning_contextes.end();)
+            {
+                auto &context = *it;
+                if (!evict_func(context.external_context, context.vpage_id, context.ppage_id, true,
+                                states[context.ppage_id].external))
+                {
+                    it++;
+                    continue;
+                }
+
+                if (!context.external_context.failed)
+                {
+                    page_table.clear_dirty(context.vpage_id, context.hint);
+                    stats.num_cleaned++;
+                }
+                page_table.release_mapping_lock(context.vpage_id, context.hint);
+                // Popped by an eviction while busy
+                if (!replacement.contains(context.ppage_id))
+                    replacement.push(context.ppage_id);
+
+                it = cleaning_contextes.erase(it);
+            }
+        }
+
+        // Writes back a dirty unpinned page while it stays resident, returns whether it is clean already
+        bool start_cleaning(vpage_id_type vpage_id,
+                            ppage_id_type ppage_id,
+                            CompactHashPageTable::packed_cache_line *hint)
+        {
+            if (!page_table.lock_mapping(vpage_id, hint))
+                return false;
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            auto &context = cleaning_contextes.emplace_back(
+                cleaning_context_type{vpage_id, ppage_id, hint, default_external_context});
+            if (!evict_func(context.external_context, vpage_id, ppage_id, true, states[ppage_id].external))
+                return false;
+            auto failed = context.external_context.failed;
+            if (!failed)
+            {
+                page_table.clear_dirty(vpage_id, hint);
+                stats.num_cleaned++;
+            }
+            page_table.release_mapping_lock(vpage_id, hint);
+            cleaning_contextes.pop_back();
+            return !failed;
+        }
+
+        // Evicts clean unpinned pages until size() is at most target, in one pass over the replacement at most.
+        // Dirty victims are passed over, pinned and busy ones are pushed again by their unpin or cleaner.
+        // release_func(ppage_id) is called for every frame freed.
+        template <typename ReleaseFuncType> void evict_clean(ppage_id_type target, ReleaseFuncType &&release_func)
+        {
+            for (auto num = replacement.size(); num > 0 && size() > target; num--)
+            {
+                auto ppage_id = replacement.pop().first;
+                auto vpage_id = states[ppage_id].internal.vpage_id;
+                auto hint = page_table.find_hint(vpage_id);
+                assert(hint != nullptr);
+                auto pte = page_table.get_pte(vpage_id, hint);
+                if (pte.ref_count != 0 || pte.busy)
+                    continue;
+                // Stays a candidate until the cleaner writes it back
+                if (pte.dirty)
+                {
+                    replacement.push(ppage_id);
+                    continue;
+                }
+                if (!page_table.delete_mapping(vpage_id, hint))
+                    continue;
+
+                stats.num_evictions++;
+                record_ghost(vpage_id);
+                init_state(ppage_id);
+                free(ppage_id);
+                page_table.release_mapping_lock(vpage_id, hint);
+                release_func(ppage_id);
+            }
+        }
+
         ppage_id_type alloc()
         {
             assert(!full());
@@ -469,6 +857,24 @@ namespace scache
 
         void free(const ppage_id_type &ppage_id) { recycle_pool.push_back(ppage_id); }
 
+        size_t ghost_slot(const vpage_id_type &vpage_id) const
+        {
+            return (vpage_id * 0x9e3779b97f4a7c15lu >> 32) % ghosts.size();
+        }
+
+        void record_ghost(const vpage_id_type &vpage_id) { ghosts[ghost_slot(vpage_id)] = vpage_id; }
+
+        void check_ghost(const vpage_id_type &vpage_id)
+        {
+            stats.num_misses++;
+            auto &ghost = ghosts[ghost_slot(vpage_id)];
+            if (ghost == vpage_id)
+            {
+                stats.num_ghost_hits++;
+                ghost = internal_state_type::EMPTY_VPAGE_ID;
+            }
+        }
+
         void init_state(const ppage_id_type &ppage_id)
         {
             states[ppage_id].internal = {internal_state_type::EMPTY_VPAGE_ID};
@@ -477,14 +883,25 @@ namespace scache
 
         const ppage_id_type max_vpage_id;
         const ppage_id_type max_ppage_id;
+        // Pages in use never exceed it, frames up to max_ppage_id back growth
+        ppage_id_type capacity;
         CompactHashPageTable page_table;
         int64_t pinned_size;
         ppage_id_type cur_id;
         std::vector<ppage_id_type> recycle_pool;
+        std::vector<ppage_id_type> held; // frames of the pages taken out
         state_type *states;
         replacement_type replacement;
         evict_func_type evict_func;
         load_func_type load_func;
         external_context_type default_external_context;
+        EvictionStats stats;
+        // Nodes never move, the backend holds pointers into in-flight contexts
+        std::list<cleaning_context_type> cleaning_contextes;
+        size_t last_clean_evictions;
+        // Frames a failed reserve() wants, the cleaner writes back one burst for them
+        ppage_id_type wanted_room;
+        // Recently evicted vpages, direct-mapped by a hash with one slot per frame
+        std::vector<vpage_id_type> ghosts;
     };
 } // namespace scache
@@ -15,6 +15,7 @@
 #pragma once
 #include "type.hpp"
 #include "util.hpp"
+#include <algorithm>
 #include <boost/fiber/all.hpp>
 #include <cstdint>
 #include <functional>
@@ -420,32 +421,38 @@ namespace scache
                     context.dirty = pre_page_table_state.value().dirty;
                 }
 
-                context.external_context = default_external_context;
-
-                context.processing = !evict_func(context.external_context, context.pre_vpage_id, context.ppage_id,
-                                                 context.dirty, state.external);
                 size++;
             }
 
-            size_t start, min_processing = 0;
-            do
+            // Write back in vpage (block) order with bounded depth, so that backends merge contiguous blocks
+            std::sort(contextes.begin(), contextes.begin() + size,
+                      [](const context_type &a, const context_type &b) { return a.pre_vpage_id < b.pre_vpage_id; });
+
+            size_t begin = 0, end = 0;
+            while (begin < size)
             {
-                start = min_processing;
-                min_processing = max_ppage_id;
-                for (size_t i = start; i < size; i++)
+                for (; end < size && end - begin < MAX_FLUSH_DEPTH; end++)
+                {
+                    auto &context = contextes[end];
+                    context.external_context = default_external_context;
+                    context.processing = !evict_func(context.external_context, context.pre_vpage_id,
+                                                     context.ppage_id, context.dirty, states[context.ppage_id].external);
+                }
+
+                for (size_t i = begin; i < end; i++)
                 {
                     auto &context = contextes[i];
                     if (context.processing)
                     {
-                        auto &state = states[context.ppage_id];
-
                         context.processing = !evict_func(context.external_context, context.pre_vpage_id,
-                                                         context.ppage_id, context.dirty, state.external);
-                        min_processing = i;
+                                                         context.ppage_id, context.dirty,
+                                                         states[context.ppage_id].external);
                     }
                 }
 
-            } while (min_processing != max_ppage_id);
+                while (begin < end && !contextes[begin].processing)
+                    begin++;
+            }
 
             for (size_t i = 0; i < size; i++)
             {
@@ -457,6 +464,8 @@ namespace scache
         }
 
     private:
+        constexpr static size_t MAX_FLUSH_DEPTH = 1024;
+
         ppage_id_type alloc()
         {
             assert(!full());
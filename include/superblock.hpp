@@ -0,0 +1,82 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "type.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace scache
+{
+    // Layout of a persistent cache, kept in its own file beside the backing stores
+    struct Superblock
+    {
+        constexpr static uint64_t MAGIC = 0x4253454843414353; // "SCACHESB"
+        constexpr static uint32_t VERSION = 1;
+
+        uint64_t magic;
+        uint32_t version;
+        uint32_t clean_shutdown;
+        uint64_t virt_size;
+        uint64_t page_size;
+        uint64_t num_partitions;
+        uint64_t partitioner; // layout of the vpage to block mapping
+
+        static Superblock create(uint64_t virt_size, uint64_t num_partitions, uint64_t partitioner)
+        {
+            return {MAGIC, VERSION, 0, virt_size, CACHE_PAGE_SIZE, num_partitions, partitioner};
+        }
+
+        bool same_layout(const Superblock &other) const
+        {
+            return virt_size == other.virt_size && page_size == other.page_size &&
+                   num_partitions == other.num_partitions && partitioner == other.partitioner;
+        }
+
+        static std::optional<Superblock> load(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return std::nullopt;
+            Superblock superblock;
+            auto ret = read(fd, &superblock, sizeof(superblock));
+            close(fd);
+            if (ret != sizeof(superblock) || superblock.magic != MAGIC || superblock.version != VERSION)
+                throw std::runtime_error("Invalid superblock " + path);
+            return superblock;
+        }
+
+        // Replaces the superblock atomically
+        void store(const std::string &path) const
+        {
+            auto tmp_path = path + ".tmp";
+            int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw std::runtime_error("Open Superblock Error");
+            if (write(fd, this, sizeof(*this)) != sizeof(*this) || fsync(fd) != 0)
+            {
+                close(fd);
+                throw std::runtime_error("Write Superblock Error");
+            }
+            close(fd);
+            if (rename(tmp_path.c_str(), path.c_str()) != 0)
+                throw std::runtime_error("Write Superblock Error");
+        }
+    };
+} // namespace scache
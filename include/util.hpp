@@ -52,6 +52,17 @@ namespace scache
 
     inline void compiler_fence() { asm volatile("" ::: "memory"); }
 
+    // Longer and lighter pause for idle loops, TPAUSE in C0.2 where the CPU supports WAITPKG
+    inline void idle_pause()
+    {
+#ifdef __WAITPKG__
+        constexpr uint64_t IDLE_PAUSE_CYCLES = 1000;
+        _tpause(0, __rdtsc() + IDLE_PAUSE_CYCLES);
+#else
+        _mm_pause();
+#endif
+    }
+
     constexpr bool MMAP_HUGEPAGE = false;
     constexpr size_t MMAP_PAGE_SIZE = 4096;
     constexpr size_t MMAP_HUGEPAGE_SIZE = 2 * 1024 * 1024;
@@ -0,0 +1,114 @@
+// Copyright 2022 Guanyu Feng, Tsinghua University
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+#include "type.hpp"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace scache
+{
+    constexpr bool ENABLE_ZERO_PAGE_ELISION = true;
+
+    // Exits at the first non-zero cache line, dirty pages usually fail fast
+    inline bool is_zero_page(const void *page)
+    {
+#ifdef __AVX2__
+        auto ptr = (const __m256i *)page;
+        for (size_t i = 0; i < CACHE_PAGE_SIZE / sizeof(__m256i); i += 2)
+        {
+            auto line = _mm256_or_si256(_mm256_load_si256(ptr + i), _mm256_load_si256(ptr + i + 1));
+            if (!_mm256_testz_si256(line, line))
+                return false;
+        }
+#else
+        auto ptr = (const uint64_t *)page;
+        for (size_t i = 0; i < CACHE_PAGE_SIZE / sizeof(uint64_t); i += 8)
+        {
+            if (ptr[i] | ptr[i + 1] | ptr[i + 2] | ptr[i + 3] | ptr[i + 4] | ptr[i + 5] | ptr[i + 6] | ptr[i + 7])
+                return false;
+        }
+#endif
+        return true;
+    }
+
+    // One bit per block, set when the latest content of the block is all zero and was never written to the backend.
+    // Backed by lazily mapped anonymous memory, so untouched ranges cost nothing. Owned by a single server thread.
+    class ZeroBlockMap
+    {
+    public:
+        ZeroBlockMap(block_id_type _num_blocks) : num_blocks(_num_blocks), num_words((num_blocks + 63) / 64)
+        {
+            bits = (uint64_t *)mmap(nullptr, num_bytes(), PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+            if (bits == MAP_FAILED)
+                throw std::runtime_error("mmap zero block map error");
+        }
+
+        ZeroBlockMap(const ZeroBlockMap &) = delete;
+        ZeroBlockMap(ZeroBlockMap &&) = delete;
+
+        ~ZeroBlockMap() { munmap(bits, num_bytes()); }
+
+        bool test(block_id_type block_id) const { return bits[block_id / 64] >> (block_id % 64) & 1; }
+        void set(block_id_type block_id) { bits[block_id / 64] |= 1lu << (block_id % 64); }
+        void reset(block_id_type block_id)
+        {
+            // Avoids faulting in untouched words of the map
+            if (test(block_id))
+                bits[block_id / 64] &= ~(1lu << (block_id % 64));
+        }
+
+        // A missing file leaves the map empty
+        void load(const std::string &path)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return;
+            auto ret = pread(fd, bits, num_bytes(), 0);
+            close(fd);
+            if (ret != (ssize_t)num_bytes())
+                throw std::runtime_error("Invalid zero block map " + path);
+        }
+
+        void store(const std::string &path) const
+        {
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw std::runtime_error("Open Zero Block Map Error");
+            if (pwrite(fd, bits, num_bytes(), 0) != (ssize_t)num_bytes() || fsync(fd) != 0)
+            {
+                close(fd);
+                throw std::runtime_error("Write Zero Block Map Error");
+            }
+            close(fd);
+        }
+
+        uint64_t num_elided_writes = 0;
+        uint64_t num_elided_reads = 0;
+
+    private:
+        size_t num_bytes() const { return num_words * sizeof(uint64_t); }
+
+        const block_id_type num_blocks;
+        const size_t num_words;
+        uint64_t *bits;
+    };
+} // namespace scache